@@ -47,13 +47,43 @@
 ///////////////////////////////////////////////////////////////////////////
 // ASTNode
 
+/** All of the AST nodes that have been allocated and not yet freed, in
+    the order they were allocated. */
+static std::vector<ASTNode *> lAllocatedNodes;
+
+ASTNode::ASTNode(SourcePos p) : pos(p) {
+    lAllocatedNodes.push_back(this);
+}
+
+
 ASTNode::~ASTNode() {
 }
 
 
+size_t
+GetASTNodeMark() {
+    return lAllocatedNodes.size();
+}
+
+
+void
+FreeASTNodes(size_t mark) {
+    Assert(mark <= lAllocatedNodes.size());
+    for (size_t i = mark; i < lAllocatedNodes.size(); ++i)
+        delete lAllocatedNodes[i];
+    lAllocatedNodes.resize(mark);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // AST
 
+AST::~AST() {
+    for (unsigned int i = 0; i < functions.size(); ++i)
+        delete functions[i];
+}
+
+
 void
 AST::AddFunction(Symbol *sym, Stmt *code) {
     if (sym == NULL)
@@ -64,8 +94,37 @@ AST::AddFunction(Symbol *sym, Stmt *code) {
 
 void
 AST::GenerateIR() {
-    for (unsigned int i = 0; i < functions.size(); ++i)
-        functions[i]->GenerateIR();
+    // Functions from the standard library only have IR generated for them
+    // if they're actually used.  Most programs call just a few of them,
+    // and generating IR for all of the rest, only to have it discarded
+    // after optimization, is a large part of the compile time for small
+    // source files.
+    std::vector<Function *> stdlibFunctions;
+    for (unsigned int i = 0; i < functions.size(); ++i) {
+        if (functions[i]->IsStdlibFunction())
+            stdlibFunctions.push_back(functions[i]);
+        else
+            functions[i]->GenerateIR();
+    }
+
+    // Generating IR for one stdlib function may introduce references to
+    // others, so keep going until no more are needed.
+    bool generatedAny = true;
+    while (generatedAny) {
+        generatedAny = false;
+        for (unsigned int i = 0; i < stdlibFunctions.size(); ++i) {
+            if (stdlibFunctions[i] != NULL &&
+                stdlibFunctions[i]->IsReferenced()) {
+                stdlibFunctions[i]->GenerateIR();
+                stdlibFunctions[i] = NULL;
+                generatedAny = true;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < stdlibFunctions.size(); ++i)
+        if (stdlibFunctions[i] != NULL)
+            stdlibFunctions[i]->RemoveDeclaration();
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -49,7 +49,7 @@
 */
 class ASTNode {
 public:
-    ASTNode(SourcePos p) : pos(p) { }
+    ASTNode(SourcePos p);
     virtual ~ASTNode();
 
     /** The Optimize() method should perform any appropriate early-stage
@@ -82,6 +82,8 @@ public:
  */
 class AST {
 public:
+    ~AST();
+
     /** Add the AST for a function described by the given declaration
         information and source code. */
     void AddFunction(Symbol *sym, Stmt *code);
@@ -95,6 +97,16 @@ private:
 };
 
 
+/** AST nodes aren't owned by the nodes that refer to them, so that they
+    can be freely shared and replaced during type checking and
+    optimization.  Instead, every node is recorded when it's allocated;
+    GetASTNodeMark() returns a marker for the nodes allocated so far, and
+    FreeASTNodes() frees all of the nodes allocated after the given
+    marker. */
+extern size_t GetASTNodeMark();
+extern void FreeASTNodes(size_t mark);
+
+
 /** Callback function type for preorder traversial visiting function for
     the AST walk.
  */
@@ -1477,6 +1477,8 @@ DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *mod
                 FATAL("Unhandled mask bit size for stdlib.ispc");
             }
         }
+        m->parsingStdlib = true;
         yyparse();
+        m->parsingStdlib = false;
     }
 }
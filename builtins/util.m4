@@ -2985,6 +2985,75 @@ ifelse(HAVE_GATHER, `1',
        @__gather_factored_base_offsets64_double(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
                                            <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
   call void @__usedouble(<WIDTH x double> %pgbo64_d)
+
+  %gs_8 = call <WIDTH x i8>
+       @__gather_strided_i8(i8 * %ptr, i64 0, <WIDTH x MASK> %mask)
+  call void @__use8(<WIDTH x i8> %gs_8)
+  %gs_16 = call <WIDTH x i16>
+       @__gather_strided_i16(i8 * %ptr, i64 0, <WIDTH x MASK> %mask)
+  call void @__use16(<WIDTH x i16> %gs_16)
+  %gs_32 = call <WIDTH x i32>
+       @__gather_strided_i32(i8 * %ptr, i64 0, <WIDTH x MASK> %mask)
+  call void @__use32(<WIDTH x i32> %gs_32)
+  %gs_f = call <WIDTH x float>
+       @__gather_strided_float(i8 * %ptr, i64 0, <WIDTH x MASK> %mask)
+  call void @__usefloat(<WIDTH x float> %gs_f)
+  %gs_64 = call <WIDTH x i64>
+       @__gather_strided_i64(i8 * %ptr, i64 0, <WIDTH x MASK> %mask)
+  call void @__use64(<WIDTH x i64> %gs_64)
+  %gs_d = call <WIDTH x double>
+       @__gather_strided_double(i8 * %ptr, i64 0, <WIDTH x MASK> %mask)
+  call void @__usedouble(<WIDTH x double> %gs_d)
+
+  %gd32_8 = call <WIDTH x i8>
+       @__gather_dedup_factored_base_offsets32_i8(i8 * %ptr, <WIDTH x i32> %v32, i32 0,
+                                           <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__use8(<WIDTH x i8> %gd32_8)
+  %gd32_16 = call <WIDTH x i16>
+       @__gather_dedup_factored_base_offsets32_i16(i8 * %ptr, <WIDTH x i32> %v32, i32 0,
+                                           <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__use16(<WIDTH x i16> %gd32_16)
+  %gd32_32 = call <WIDTH x i32>
+       @__gather_dedup_factored_base_offsets32_i32(i8 * %ptr, <WIDTH x i32> %v32, i32 0,
+                                           <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__use32(<WIDTH x i32> %gd32_32)
+  %gd32_f = call <WIDTH x float>
+       @__gather_dedup_factored_base_offsets32_float(i8 * %ptr, <WIDTH x i32> %v32, i32 0,
+                                           <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__usefloat(<WIDTH x float> %gd32_f)
+  %gd32_64 = call <WIDTH x i64>
+       @__gather_dedup_factored_base_offsets32_i64(i8 * %ptr, <WIDTH x i32> %v32, i32 0,
+                                           <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__use64(<WIDTH x i64> %gd32_64)
+  %gd32_d = call <WIDTH x double>
+       @__gather_dedup_factored_base_offsets32_double(i8 * %ptr, <WIDTH x i32> %v32, i32 0,
+                                           <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__usedouble(<WIDTH x double> %gd32_d)
+
+  %gd64_8 = call <WIDTH x i8>
+       @__gather_dedup_factored_base_offsets64_i8(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
+                                           <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__use8(<WIDTH x i8> %gd64_8)
+  %gd64_16 = call <WIDTH x i16>
+       @__gather_dedup_factored_base_offsets64_i16(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
+                                           <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__use16(<WIDTH x i16> %gd64_16)
+  %gd64_32 = call <WIDTH x i32>
+       @__gather_dedup_factored_base_offsets64_i32(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
+                                           <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__use32(<WIDTH x i32> %gd64_32)
+  %gd64_f = call <WIDTH x float>
+       @__gather_dedup_factored_base_offsets64_float(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
+                                           <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__usefloat(<WIDTH x float> %gd64_f)
+  %gd64_64 = call <WIDTH x i64>
+       @__gather_dedup_factored_base_offsets64_i64(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
+                                           <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__use64(<WIDTH x i64> %gd64_64)
+  %gd64_d = call <WIDTH x double>
+       @__gather_dedup_factored_base_offsets64_double(i8 * %ptr, <WIDTH x i64> %v64, i32 0,
+                                           <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__usedouble(<WIDTH x double> %gd64_d)
 ')
 
   ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -3124,6 +3193,12 @@ ifelse(HAVE_SCATTER, `1',
                                                  <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
   call void @__scatter_factored_base_offsets64_double(i8 * %ptr, <WIDTH x i64> %v64, i32 0, <WIDTH x i64> %v64,
                                                     <WIDTH x double> %vd, <WIDTH x MASK> %mask)
+  call void @__scatter_strided_i8(i8 * %ptr, i64 0, <WIDTH x i8> %v8, <WIDTH x MASK> %mask)
+  call void @__scatter_strided_i16(i8 * %ptr, i64 0, <WIDTH x i16> %v16, <WIDTH x MASK> %mask)
+  call void @__scatter_strided_i32(i8 * %ptr, i64 0, <WIDTH x i32> %v32, <WIDTH x MASK> %mask)
+  call void @__scatter_strided_float(i8 * %ptr, i64 0, <WIDTH x float> %vf, <WIDTH x MASK> %mask)
+  call void @__scatter_strided_i64(i8 * %ptr, i64 0, <WIDTH x i64> %v64, <WIDTH x MASK> %mask)
+  call void @__scatter_strided_double(i8 * %ptr, i64 0, <WIDTH x double> %vd, <WIDTH x MASK> %mask)
 ')
 
   ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -4580,6 +4655,71 @@ define <WIDTH x $1> @__gather64_$1(<WIDTH x i64> %ptrs,
 ')
 
 ; vec width, type
+;; $1: scalar type of the gathered elements
+;; $2: offset width (32 or 64)
+
+define(`gen_gather_dedup', `
+declare_count_zeros()
+
+define <WIDTH x $1> @__gather_dedup_factored_base_offsets$2_$1(i8 * %ptr, <WIDTH x i$2> %offsets,
+                                             i32 %offset_scale, <WIDTH x i$2> %offset_delta,
+                                             <WIDTH x MASK> %vecmask) nounwind readonly alwaysinline {
+entry:
+  %mm = call i64 @__movmsk(<WIDTH x MASK> %vecmask)
+  %anyon = icmp ne i64 %mm, 0
+  br i1 %anyon, label %check, label %gather
+
+check:
+  ; compare the offsets and deltas of all lanes against those of the
+  ; first active lane
+  %first = call i64 @llvm.cttz.i64(i64 %mm)
+  %first32 = trunc i64 %first to i32
+  %off0 = extractelement <WIDTH x i$2> %offsets, i32 %first32
+  %offv = insertelement <WIDTH x i$2> undef, i$2 %off0, i32 0
+  %offsmear = shufflevector <WIDTH x i$2> %offv, <WIDTH x i$2> undef,
+        <WIDTH x i32> < forloop(i, 0, eval(WIDTH-2), `i32 0, ') i32 0 >
+  %delta0 = extractelement <WIDTH x i$2> %offset_delta, i32 %first32
+  %deltav = insertelement <WIDTH x i$2> undef, i$2 %delta0, i32 0
+  %deltasmear = shufflevector <WIDTH x i$2> %deltav, <WIDTH x i$2> undef,
+        <WIDTH x i32> < forloop(i, 0, eval(WIDTH-2), `i32 0, ') i32 0 >
+  %offeq = icmp eq <WIDTH x i$2> %offsets, %offsmear
+  %deltaeq = icmp eq <WIDTH x i$2> %offset_delta, %deltasmear
+  %eq = and <WIDTH x i1> %offeq, %deltaeq
+  ifelse(MASK,i1, `
+  %eqmm = call i64 @__movmsk(<WIDTH x MASK> %eq)',
+  `%eqm = sext <WIDTH x i1> %eq to <WIDTH x MASK>
+  %eqmm = call i64 @__movmsk(<WIDTH x MASK> %eqm)')
+  ; inactive lanes are free to differ
+  %noteqmm = xor i64 %eqmm, -1
+  %mismatch = and i64 %mm, %noteqmm
+  %same = icmp eq i64 %mismatch, 0
+  br i1 %same, label %broadcast, label %gather
+
+broadcast:
+  ifelse($2, `32', `
+  %off64 = sext i32 %off0 to i64
+  %delta64 = sext i32 %delta0 to i64', `
+  %off64 = bitcast i64 %off0 to i64
+  %delta64 = bitcast i64 %delta0 to i64')
+  %scale64 = sext i32 %offset_scale to i64
+  %offset = mul i64 %off64, %scale64
+  %ptroffset = getelementptr PTR_OP_ARGS(`i8') %ptr, i64 %offset
+  %finalptr = getelementptr PTR_OP_ARGS(`i8') %ptroffset, i64 %delta64
+  %ptrcast = bitcast i8 * %finalptr to $1 *
+  %val = load PTR_OP_ARGS(`$1 ') %ptrcast
+  %valv = insertelement <WIDTH x $1> undef, $1 %val, i32 0
+  %valsmear = shufflevector <WIDTH x $1> %valv, <WIDTH x $1> undef,
+        <WIDTH x i32> < forloop(i, 0, eval(WIDTH-2), `i32 0, ') i32 0 >
+  ret <WIDTH x $1> %valsmear
+
+gather:
+  %v = call <WIDTH x $1> @__gather_factored_base_offsets$2_$1(i8 * %ptr, <WIDTH x i$2> %offsets,
+                                             i32 %offset_scale, <WIDTH x i$2> %offset_delta,
+                                             <WIDTH x MASK> %vecmask)
+  ret <WIDTH x $1> %v
+}
+')
+
 define(`gen_gather_factored', `
 ;; Define the utility function to do the gather operation for a single element
 ;; of the type
@@ -4690,6 +4830,36 @@ define <WIDTH x $1> @__gather_factored_base_offsets64_$1(i8 * %ptr, <WIDTH x i64
   ret <WIDTH x $1> %ret`'eval(WIDTH-1)
 }
 
+; gather where lane i reads from ptr + i * stride, for a uniform stride
+; in bytes; used in place of the factored gathers above when the
+; optimizer can prove the offsets have this form, so that no vector of
+; offsets needs to be computed and taken apart
+define <WIDTH x $1> @__gather_strided_$1(i8 * %ptr, i64 %stride,
+                                        <WIDTH x MASK> %vecmask) nounwind readonly alwaysinline {
+  %ret_ptr = alloca <WIDTH x $1>
+  per_lane(WIDTH, <WIDTH x MASK> %vecmask, `
+  %lane64_LANE_ID = zext i32 LANE to i64
+  %offset_LANE_ID = mul i64 %stride, %lane64_LANE_ID
+  %ptroffset_LANE_ID = getelementptr PTR_OP_ARGS(`i8') %ptr, i64 %offset_LANE_ID
+  %ptrcast_LANE_ID = bitcast i8 * %ptroffset_LANE_ID to $1 *
+  %val_LANE_ID = load PTR_OP_ARGS(`$1 ')  %ptrcast_LANE_ID
+  %store_ptr_LANE_ID = getelementptr PTR_OP_ARGS(`<WIDTH x $1>') %ret_ptr, i32 0, i32 LANE
+  store $1 %val_LANE_ID, $1 * %store_ptr_LANE_ID
+ ')
+
+  %ret = load PTR_OP_ARGS(`<WIDTH x $1> ')  %ret_ptr
+  ret <WIDTH x $1> %ret
+}
+
+; variants of the factored gathers above that first check whether all of
+; the active lanes are reading from the same location; if so, they issue
+; a single scalar load and broadcast its value rather than going through
+; the per-lane gather.  These are used in place of the regular factored
+; gathers for --opt=dedup-gathers, where the indices are expected to have
+; low entropy (e.g. lookups into a small table).
+gen_gather_dedup($1, 32)
+gen_gather_dedup($1, 64)
+
 gen_gather_general($1)
 '
 )
@@ -4799,6 +4969,21 @@ define void @__scatter_factored_base_offsets64_$1(i8* %base, <WIDTH x i64> %offs
   ret void
 }
 
+; scatter where lane i writes to ptr + i * stride, for a uniform stride
+; in bytes (the counterpart of __gather_strided)
+define void @__scatter_strided_$1(i8 * %ptr, i64 %stride, <WIDTH x $1> %values,
+                                  <WIDTH x MASK> %mask) nounwind alwaysinline {
+  per_lane(WIDTH, <WIDTH x MASK> %mask, `
+  %lane64_LANE_ID = zext i32 LANE to i64
+  %offset_LANE_ID = mul i64 %stride, %lane64_LANE_ID
+  %ptroffset_LANE_ID = getelementptr PTR_OP_ARGS(`i8') %ptr, i64 %offset_LANE_ID
+  %ptrcast_LANE_ID = bitcast i8 * %ptroffset_LANE_ID to $1 *
+  %storeval_LANE_ID = extractelement <WIDTH x $1> %values, i32 LANE
+  store $1 %storeval_LANE_ID, $1 * %ptrcast_LANE_ID
+ ')
+  ret void
+}
+
 ; fully general 32-bit scatter, takes array of pointers encoded as vector of i32s
 define void @__scatter32_$1(<WIDTH x i32> %ptrs, <WIDTH x $1> %values,
                             <WIDTH x MASK> %mask) nounwind alwaysinline {
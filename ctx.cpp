@@ -277,6 +277,7 @@ FunctionEmitContext::FunctionEmitContext(Function *func, Symbol *funSym,
     launchGroupHandlePtr = AllocaInst(LLVMTypes::VoidPointerType, "launch_group_handle");
     StoreInst(llvm::Constant::getNullValue(LLVMTypes::VoidPointerType),
               launchGroupHandlePtr);
+    asyncLaunchHandlePtr = NULL;
 
     disableGSWarningCount = 0;
 
@@ -3848,7 +3849,11 @@ llvm::Instruction *
 FunctionEmitContext::ReturnInst() {
     AddProfileEnd(PROFILE_REGION_FUNCTION);
 
-    if (launchedTasks)
+    if (asyncLaunchHandlePtr != NULL)
+        // Leave it to the caller to sync the tasks (if any) that we
+        // launched
+        StoreInst(LoadInst(launchGroupHandlePtr), asyncLaunchHandlePtr);
+    else if (launchedTasks)
         // Add a sync call at the end of any function that launched tasks
         SyncInst();
 
@@ -4051,6 +4056,18 @@ FunctionEmitContext::LaunchInst(llvm::Value *callee,
 }
 
 
+void
+FunctionEmitContext::SetAsyncLaunchHandlePtr(llvm::Value *ptr) {
+    asyncLaunchHandlePtr = ptr;
+}
+
+
+llvm::Value *
+FunctionEmitContext::GetAsyncLaunchHandlePtr() const {
+    return asyncLaunchHandlePtr;
+}
+
+
 void
 FunctionEmitContext::SyncInst() {
 #ifdef ISPC_NVPTX_ENABLED 
@@ -576,6 +576,17 @@ public:
 
     void SyncInst();
 
+    /** Makes the function hand the group of tasks it launched back to its
+        caller rather than waiting for them before returning: at each
+        return, the launch group handle (NULL if no tasks were launched) is
+        stored through the given void ** value instead of calling
+        ISPCSync(). */
+    void SetAsyncLaunchHandlePtr(llvm::Value *ptr);
+
+    /** Returns the value set by SetAsyncLaunchHandlePtr(), or NULL if the
+        function syncs its tasks before returning. */
+    llvm::Value *GetAsyncLaunchHandlePtr() const;
+
     llvm::Instruction *ReturnInst();
     /** @} */
 
@@ -724,6 +735,11 @@ private:
         tasks launched from the current function. */
     llvm::Value *launchGroupHandlePtr;
 
+    /** For the asynchronous variants of exported functions, the void **
+        parameter through which the launch group handle is returned to the
+        caller; NULL otherwise. */
+    llvm::Value *asyncLaunchHandlePtr;
+
     /** Nesting count of the number of times calling code has disabled (and
         not yet reenabled) gather/scatter performance warnings. */
     int disableGSWarningCount;
@@ -45,6 +45,7 @@
 #include "expr.h"
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include <set>
 
 static void
@@ -123,6 +124,60 @@ lApplyTypeQualifiers(int typeQualifiers, const Type *type, SourcePos pos) {
 }
 
 
+static bool
+lIsSpecializeDeclSpec(const std::string &str) {
+    return !strncmp(str.c_str(), "specialize(", 11);
+}
+
+
+/** Parses the values from a "specialize(...)" __declspec on a function
+    parameter of the given type, checking that they can be represented
+    in it.  Returns false if there was an error. */
+static bool
+lGetSpecializationValues(const std::string &str, const Type *type,
+                         const std::string &name, SourcePos pos,
+                         std::vector<int64_t> *values) {
+    const AtomicType *at = CastType<AtomicType>(type);
+    if (at == NULL || at->IsUniformType() == false ||
+        at->IsIntType() == false) {
+        Error(pos, "\"specialize\" can only be applied to parameters with "
+              "uniform integer types; \"%s\" has type \"%s\".", name.c_str(),
+              type->GetString().c_str());
+        return false;
+    }
+
+    int64_t minValue, maxValue;
+    switch (at->basicType) {
+    case AtomicType::TYPE_INT8:   minValue = INT8_MIN;  maxValue = INT8_MAX;   break;
+    case AtomicType::TYPE_UINT8:  minValue = 0;         maxValue = UINT8_MAX;  break;
+    case AtomicType::TYPE_INT16:  minValue = INT16_MIN; maxValue = INT16_MAX;  break;
+    case AtomicType::TYPE_UINT16: minValue = 0;         maxValue = UINT16_MAX; break;
+    case AtomicType::TYPE_INT32:  minValue = INT32_MIN; maxValue = INT32_MAX;  break;
+    case AtomicType::TYPE_UINT32: minValue = 0;         maxValue = UINT32_MAX; break;
+    case AtomicType::TYPE_INT64:  minValue = INT64_MIN; maxValue = INT64_MAX;  break;
+    default:                      minValue = 0;         maxValue = INT64_MAX;  break;
+    }
+
+    // The values were written into the string by the parser, so we don't
+    // need to worry about malformed input here.
+    const char *p = str.c_str() + 11;
+    while (*p != ')') {
+        char *end;
+        int64_t value = strtoll(p, &end, 10);
+        if (value < minValue || value > maxValue) {
+            Error(pos, "Value %lld to specialize parameter \"%s\" for can't be "
+                  "represented in its type \"%s\".", (long long)value,
+                  name.c_str(), type->GetString().c_str());
+            return false;
+        }
+        if (std::find(values->begin(), values->end(), value) == values->end())
+            values->push_back(value);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // DeclSpecs
 
@@ -267,10 +322,16 @@ Declarator::InitFromDeclSpecs(DeclSpecs *ds) {
 
     storageClass = ds->storageClass;
 
+    // "specialize" is applied to function parameters; it's checked when
+    // the function's type is created.
     if (ds->declSpecList.size() > 0 &&
         CastType<FunctionType>(type) == NULL) {
-        Error(pos, "__declspec specifiers for non-function type \"%s\" are "
-              "not used.", type->GetString().c_str());
+        for (int i = 0; i < (int)ds->declSpecList.size(); ++i)
+            if (!lIsSpecializeDeclSpec(ds->declSpecList[i].first)) {
+                Error(pos, "__declspec specifiers for non-function type \"%s\" are "
+                      "not used.", type->GetString().c_str());
+                break;
+            }
     }
 }
 
@@ -434,6 +495,7 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
         llvm::SmallVector<std::string, 8> argNames;
         llvm::SmallVector<Expr *, 8> argDefaults;
         llvm::SmallVector<SourcePos, 8> argPos;
+        std::vector<std::pair<int, std::vector<int64_t> > > specializations;
 
         // Loop over the function arguments and store the names, types,
         // default values (if any), and source file positions each one in
@@ -508,6 +570,17 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
                 }
             }
 
+            for (int j = 0; j < (int)d->declSpecs->declSpecList.size(); ++j) {
+                const std::string &str = d->declSpecs->declSpecList[j].first;
+                if (!lIsSpecializeDeclSpec(str))
+                    continue;
+                std::vector<int64_t> values;
+                if (lGetSpecializationValues(str, decl->type, decl->name,
+                                             d->declSpecs->declSpecList[j].second,
+                                             &values))
+                    specializations.push_back(std::make_pair((int)i, values));
+            }
+
             args.push_back(decl->type);
             argNames.push_back(decl->name);
             argPos.push_back(decl->pos);
@@ -596,11 +669,30 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
                               cost);
                     (const_cast<FunctionType *>(functionType))->costOverride = cost;
                 }
+                else if (str == "async") {
+                    if (!isExported)
+                        Error(pos, "\"async\" can only be used with \"export\" "
+                              "functions.");
+                    else if (!returnType->IsVoidType())
+                        Error(pos, "\"async\" can only be used with functions "
+                              "that return \"void\".");
+                    else
+                        (const_cast<FunctionType *>(functionType))->isAsync = true;
+                }
                 else
                     Error(pos, "__declspec parameter \"%s\" unknown.", str.c_str());
             }
         }
 
+        if (specializations.size() > 0) {
+            if (isExported)
+                (const_cast<FunctionType *>(functionType))->specializations =
+                    specializations;
+            else
+                Warning(pos, "\"specialize\" is only used for parameters of "
+                        "\"export\" functions.");
+        }
+
         child->InitFromType(functionType, ds);
         type = child->type;
         name = child->name;
@@ -635,6 +727,11 @@ Declaration::GetVariableDeclarations() const {
     Assert(declSpecs->storageClass != SC_TYPEDEF);
     std::vector<VariableDeclaration> vars;
 
+    for (int i = 0; i < (int)declSpecs->declSpecList.size(); ++i)
+        if (lIsSpecializeDeclSpec(declSpecs->declSpecList[i].first))
+            Error(declSpecs->declSpecList[i].second, "\"specialize\" can "
+                  "only be applied to function parameters.");
+
     for (unsigned int i = 0; i < declarators.size(); ++i) {
         Declarator *decl = declarators[i];
         if (decl == NULL || decl->type == NULL) {
@@ -0,0 +1,112 @@
+/*
+  Copyright (c) 2015, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Compiles an ispc function at run time with libispc (see ispc_jit.h),
+   specializing it for a scale factor that's only known when the program
+   runs, and checks the results of calling it.  The function is compiled
+   many times over, as an application that specializes kernels on the fly
+   would, to make sure that repeated compilation works. */
+
+#include <stdio.h>
+#include "ispc_jit.h"
+
+static const char *kernelSource =
+    "export void scale(uniform float vin[], uniform float vout[],\n"
+    "                  uniform int count) {\n"
+    "    foreach (i = 0 ... count)\n"
+    "        vout[i] = SCALE * vin[i];\n"
+    "}\n";
+
+typedef void (*ScaleFunc)(float *vin, float *vout, int count);
+
+int main() {
+    ispc_jit *jit = ispc_jit_create(NULL /* host ISA */, NULL /* host CPU */, 1);
+    if (jit == NULL) {
+        fprintf(stderr, "Unable to create JIT compiler.\n");
+        return 1;
+    }
+
+    const int count = 37;
+    float vin[count], vout[count];
+    for (int i = 0; i < count; ++i)
+        vin[i] = (float)i;
+
+    int errors = 0;
+    for (int factor = 1; factor <= 50; ++factor) {
+        char source[1024];
+        snprintf(source, sizeof(source), "#define SCALE %d.f\n%s", factor,
+                 kernelSource);
+
+        ispc_jit_module *module = ispc_jit_compile(jit, source, "scale.ispc");
+        if (module == NULL) {
+            fprintf(stderr, "Compilation failed for factor %d.\n", factor);
+            ++errors;
+            break;
+        }
+
+        ScaleFunc func = (ScaleFunc)ispc_jit_get_function(module, "scale");
+        if (func == NULL) {
+            fprintf(stderr, "Exported function \"scale\" not found.\n");
+            ispc_jit_free_module(module);
+            ++errors;
+            break;
+        }
+        if (ispc_jit_get_function(module, "no_such_function") != NULL) {
+            fprintf(stderr, "Found a function that doesn't exist.\n");
+            ++errors;
+        }
+
+        func(vin, vout, count);
+        for (int i = 0; i < count; ++i) {
+            if (vout[i] != factor * vin[i]) {
+                fprintf(stderr, "Factor %d, element %d: got %f, expected %f\n",
+                        factor, i, vout[i], factor * vin[i]);
+                ++errors;
+            }
+        }
+        ispc_jit_free_module(module);
+    }
+
+    // Programs with errors should be rejected (after their errors are
+    // printed).
+    if (ispc_jit_compile(jit, "export void broken( {", "broken.ispc") != NULL) {
+        fprintf(stderr, "Compiling an invalid program succeeded.\n");
+        ++errors;
+    }
+
+    ispc_jit_destroy(jit);
+
+    if (errors == 0)
+        printf("In-process compilation test passed.\n");
+    return errors > 0;
+}
@@ -70,6 +70,28 @@
 
 #define ISPC_USE_CREW
 
+  The number of threads used and the CPUs they run on can be controlled at
+  run time with two environment variables:
+
+    ISPC_NUM_THREADS=<n>       total number of threads that run tasks,
+                               including the thread that calls into ispc code
+    ISPC_AFFINITY=<cpu list>   pin the worker threads to the given CPUs in
+                               round-robin order, e.g. "0-3,8,10-11"
+
+  If ISPC_NUM_THREADS isn't set, the thread count is derived from the CPUs
+  the process is actually allowed to use: on Linux this honors the
+  sched_getaffinity() mask and any cgroup CPU quota (as set up by container
+  runtimes), rather than just the number of online CPUs.  GCD manages its
+  own thread pool, so neither variable has any effect there; ISPC_AFFINITY
+  is also ignored with ConcRT and Cilk, which don't allow pinning their
+  worker threads.
+
+  Applications can give the tasks they launch a priority (and optionally a
+  deadline) with ISPCSetLaunchPriority(); see its declaration below.  The
+  pthreads task system always runs tasks from the highest-priority task
+  groups first, and GCD maps priorities to its global queue priorities;
+  the other task systems ignore them.
+
 */
 
 #if !(defined ISPC_USE_CONCRT          || defined ISPC_USE_GCD              || \
@@ -102,6 +124,12 @@
 #define ISPC_IS_KNC
 #endif
 
+#ifdef _MSC_VER
+#define ISPC_THREAD_LOCAL __declspec(thread)
+#else
+#define ISPC_THREAD_LOCAL __thread
+#endif
+
 
 #define DBG(x) 
 
@@ -128,6 +156,7 @@
   #include <sys/param.h>
   #include <sys/sysctl.h>
   #include <vector>
+  #include <map>
   #include <algorithm>
 #endif // ISPC_USE_PTHREADS
 #ifdef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
@@ -151,15 +180,26 @@
 #ifdef ISPC_USE_TBB_TASK_GROUP
   #include <tbb/task_group.h>
 #endif // ISPC_USE_TBB_TASK_GROUP
+#if defined(ISPC_USE_TBB_PARALLEL_FOR) || defined(ISPC_USE_TBB_TASK_GROUP)
+  #include <tbb/task_arena.h>
+  #include <tbb/task_scheduler_observer.h>
+#endif // ISPC_USE_TBB_PARALLEL_FOR || ISPC_USE_TBB_TASK_GROUP
 #ifdef ISPC_USE_CILK
   #include <cilk/cilk.h>
+  #include <cilk/cilk_api.h>
 #endif // ISPC_USE_TBB
 #ifdef ISPC_USE_OMP
   #include <omp.h>
 #endif // ISPC_USE_OMP
 #ifdef ISPC_IS_LINUX
   #include <malloc.h>
+  #include <sched.h>
+  #include <unistd.h>
+  #include <errno.h>
 #endif // ISPC_IS_LINUX
+#ifdef ISPC_IS_APPLE
+  #include <unistd.h>
+#endif // ISPC_IS_APPLE
 
 #include <stdio.h>
 #include <stdint.h>
@@ -167,6 +207,9 @@
 #include <assert.h>
 #include <string.h>
 #include <algorithm>
+#ifndef ISPC_IS_WINDOWS
+  #include <sys/time.h>
+#endif // !ISPC_IS_WINDOWS
 
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
@@ -174,6 +217,10 @@ typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
                              int taskIndex0, int taskIndex1, int taskIndex2,
                              int taskCount0, int taskCount1, int taskCount2);
 
+#ifdef ISPC_USE_GCD
+class TaskGroup;
+#endif // ISPC_USE_GCD
+
 // Small structure used to hold the data for each task
 #ifdef _MSC_VER
 __declspec(align(16))
@@ -185,6 +232,9 @@ struct TaskInfo {
     int taskCount3d[3];
 #if defined(  ISPC_USE_CONCRT)
     event taskEvent;
+#endif
+#if defined(ISPC_USE_GCD)
+    TaskGroup *taskGroup;
 #endif
     int taskCount() const { return taskCount3d[0]*taskCount3d[1]*taskCount3d[2]; }
     int taskIndex0() const 
@@ -214,6 +264,16 @@ extern "C" {
     void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
     void ISPCSync(void *handle);
+
+    /* Sets the priority of the tasks subsequently launched by ispc
+       functions called from the current thread (and of the tasks that
+       those tasks launch in turn); tasks with a higher priority are run
+       before ones with a lower priority.  The default priority is zero.
+       If deadlineMicroseconds is non-zero, it gives a hint of how soon
+       (counting from the time of this call) the tasks should be done;
+       among task groups with the same priority, the one with the earliest
+       deadline is served first.  Returns the previous priority. */
+    int ISPCSetLaunchPriority(int priority, int64_t deadlineMicroseconds);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -243,6 +303,11 @@ public:
 
     void *AllocMemory(int64_t size, int32_t alignment);
 
+    /* Priority and absolute deadline (in lMicroseconds() time, or zero
+       if there's no deadline) of the tasks in this group. */
+    int priority;
+    int64_t deadline;
+
 protected:
     TaskGroupBase();
     ~TaskGroupBase();
@@ -260,7 +325,10 @@ private:
     /* We also allocate chunks of memory to service ISPCAlloc() calls.  The
        memBuffers[] array holds pointers to this memory.  The first element
        of this array is initialized to point to mem and then any subsequent
-       elements required are initialized with dynamic allocation.
+       elements required are initialized with dynamic allocation.  Element
+       i is (at least) 1<<(12+i) bytes; the buffers are kept when the task
+       group is reset, so that a recycled task group only needs to go to
+       the heap if it's asked for more memory than it ever was before.
      */
     int curMemBuffer, curMemBufferOffset;
     int memBufferSize[NUM_MEM_BUFFERS];
@@ -271,6 +339,8 @@ private:
 
 inline TaskGroupBase::TaskGroupBase() { 
     nextTaskInfoIndex = 0; 
+    priority = 0;
+    deadline = 0;
 
     curMemBuffer = 0; 
     curMemBufferOffset = 0;
@@ -348,9 +418,14 @@ TaskGroupBase::AllocMemory(int64_t size, int32_t alignment) {
 
     int allocSize = 1 << (12 + curMemBuffer);
     allocSize = std::max(int(size+alignment), allocSize);
-    char *newBuf = new char[allocSize];
-    memBufferSize[curMemBuffer] = allocSize;
-    memBuffers[curMemBuffer] = newBuf;
+    if (memBufferSize[curMemBuffer] < allocSize) {
+        // Either this is the first time we've gotten this far, or the
+        // buffer left over from an earlier use of this task group is too
+        // small.
+        delete[](memBuffers[curMemBuffer]);
+        memBuffers[curMemBuffer] = new char[allocSize];
+        memBufferSize[curMemBuffer] = allocSize;
+    }
     return AllocMemory(size, alignment);
 }
 
@@ -398,6 +473,248 @@ lAtomicAdd(volatile int32_t *v, int32_t delta) {
 #endif
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Thread count and affinity configuration
+
+#define MAX_AFFINITY_CPUS 1024
+
+/* Total number of threads to run tasks on (including the thread that
+   calls into ispc code) and the list of CPUs to pin worker threads to, as
+   set up by lInitThreadConfig().  An empty CPU list means that threads
+   aren't pinned. */
+static int configNumThreads = 0;
+static bool configNumThreadsFromEnv = false;
+static int configAffinityCPUs[MAX_AFFINITY_CPUS];
+static int configNumAffinityCPUs = 0;
+static volatile int32_t configLock = 0;
+
+
+/** Parses a CPU list of the form "0-3,8,10-11" into the given array,
+    returning the number of CPUs found, or -1 if the string is malformed.
+ */
+static int
+lParseCPUList(const char *str, int *cpus, int maxCPUs) {
+    int count = 0;
+    const char *p = str;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && count < maxCPUs; ++cpu)
+            cpus[count++] = (int)cpu;
+
+        if (*p == ',')
+            ++p;
+        else if (*p != '\0')
+            return -1;
+    }
+    return count;
+}
+
+
+#ifdef ISPC_IS_LINUX
+/** Returns the number of CPUs' worth of time that the cgroup the process
+    runs in is allowed to use, or -1 if there is no quota.  Both the cgroup
+    v2 (cpu.max) and the v1 (cpu.cfs_quota_us) interfaces are checked; as
+    containers see their own cgroup at the root of the hierarchy, we only
+    look there.
+ */
+static int
+lCgroupCPUQuota() {
+    long long quota = -1, period = 0;
+    FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f != NULL) {
+        char quotaStr[32];
+        if (fscanf(f, "%31s %lld", quotaStr, &period) == 2 &&
+            strcmp(quotaStr, "max") != 0)
+            quota = atoll(quotaStr);
+        fclose(f);
+    }
+    else {
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        if (f != NULL) {
+            if (fscanf(f, "%lld", &quota) != 1)
+                quota = -1;
+            fclose(f);
+        }
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        if (f != NULL) {
+            if (fscanf(f, "%lld", &period) != 1)
+                period = 0;
+            fclose(f);
+        }
+    }
+
+    if (quota <= 0 || period <= 0)
+        return -1;
+    // Round up: a quota of 1.5 CPUs can keep two threads reasonably busy.
+    return (int)((quota + period - 1) / period);
+}
+#endif // ISPC_IS_LINUX
+
+
+/** Returns the number of CPUs that the process may run on.
+ */
+static int
+lAvailableCPUs() {
+#if defined(ISPC_IS_WINDOWS)
+    DWORD_PTR processMask, systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        int count = 0;
+        for (; processMask != 0; processMask &= processMask - 1)
+            ++count;
+        return count;
+    }
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    return (int)sysInfo.dwNumberOfProcessors;
+#elif defined(ISPC_IS_LINUX)
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0)
+        count = CPU_COUNT(&cpuset);
+    int quota = lCgroupCPUQuota();
+    if (quota > 0 && quota < count)
+        count = quota;
+    return count;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+
+/** Reads the ISPC_NUM_THREADS and ISPC_AFFINITY environment variables and
+    sets up configNumThreads and configAffinityCPUs accordingly.  This is
+    safe to call from multiple threads; only the first call does any work.
+ */
+static void
+lInitThreadConfig() {
+    if (configNumThreads != 0)
+        return;
+
+    while (1) {
+        if (lAtomicCompareAndSwap32(&configLock, 1, 0) == 0) {
+            if (configNumThreads == 0) {
+                const char *affinity = getenv("ISPC_AFFINITY");
+                if (affinity != NULL) {
+                    configNumAffinityCPUs =
+                        lParseCPUList(affinity, configAffinityCPUs, MAX_AFFINITY_CPUS);
+                    if (configNumAffinityCPUs < 0) {
+                        fprintf(stderr, "Ignoring malformed ISPC_AFFINITY "
+                                "value \"%s\".\n", affinity);
+                        configNumAffinityCPUs = 0;
+                    }
+                }
+
+                int nThreads = 0;
+                const char *numThreads = getenv("ISPC_NUM_THREADS");
+                if (numThreads != NULL) {
+                    nThreads = atoi(numThreads);
+                    if (nThreads > 0)
+                        configNumThreadsFromEnv = true;
+                    else
+                        fprintf(stderr, "Ignoring invalid ISPC_NUM_THREADS "
+                                "value \"%s\".\n", numThreads);
+                }
+                if (nThreads <= 0) {
+                    // With an explicit CPU list, by default run one thread
+                    // per listed CPU.
+                    nThreads = (configNumAffinityCPUs > 0) ?
+                        configNumAffinityCPUs : lAvailableCPUs();
+                }
+
+                lMemFence();
+                configNumThreads = std::max(1, nThreads);
+            }
+            lMemFence();
+            configLock = 0;
+            break;
+        }
+    }
+}
+
+
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_OMP) || \
+    defined(ISPC_USE_TBB_PARALLEL_FOR) || defined(ISPC_USE_TBB_TASK_GROUP)
+/** Pins the calling thread to the CPU assigned to the given thread slot
+    by ISPC_AFFINITY; does nothing if no affinity was requested.
+ */
+static void
+lPinCurrentThread(int slot) {
+    if (configNumAffinityCPUs == 0)
+        return;
+    int cpu = configAffinityCPUs[slot % configNumAffinityCPUs];
+#if defined(ISPC_IS_WINDOWS)
+    if (cpu < (int)(8 * sizeof(DWORD_PTR)) &&
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0)
+        fprintf(stderr, "Unable to pin thread to CPU %d.\n", cpu);
+#elif defined(ISPC_IS_LINUX)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0)
+        fprintf(stderr, "Unable to pin thread to CPU %d: %s\n", cpu,
+                strerror(errno));
+#else
+    // No way to pin threads to specific CPUs on this platform.
+    (void)cpu;
+#endif
+}
+#endif // ISPC_USE_PTHREADS || ISPC_USE_OMP || ISPC_USE_TBB_*
+
+///////////////////////////////////////////////////////////////////////////
+// Launch priorities
+
+// Priority and deadline set with ISPCSetLaunchPriority() on this thread.
+static ISPC_THREAD_LOCAL int launchPriority;
+static ISPC_THREAD_LOCAL int64_t launchDeadline;
+
+static int64_t
+lMicroseconds() {
+#ifdef ISPC_IS_WINDOWS
+    return (int64_t)GetTickCount64() * 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif // ISPC_IS_WINDOWS
+}
+
+
+int
+ISPCSetLaunchPriority(int priority, int64_t deadlineMicroseconds) {
+    int oldPriority = launchPriority;
+    launchPriority = priority;
+    launchDeadline = (deadlineMicroseconds != 0) ?
+        lMicroseconds() + deadlineMicroseconds : 0;
+    return oldPriority;
+}
+
+
+/** Returns true if the tasks of a task group with priority p0 and
+    deadline d0 should be run before those of one with priority p1 and
+    deadline d1. */
+static inline bool
+lRunsBefore(int p0, int64_t d0, int p1, int64_t d1) {
+    if (p0 != p1)
+        return p0 > p1;
+    // No deadline sorts after any deadline
+    if (d0 == 0 || d1 == 0)
+        return d0 != 0 && d1 == 0;
+    return d0 < d1;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 
 #ifdef ISPC_USE_CONCRT
@@ -437,18 +754,46 @@ public:
         numUnfinishedTasks = 0;
         waitingTasks.reserve(128);
         inActiveList = false;
+        parent = root = NULL;
+        depth = 0;
     }
 
     void Reset() {
         TaskGroupBase::Reset();
         numUnfinishedTasks = 0;
         assert(inActiveList == false);
+        parent = root = NULL;
+        depth = 0;
         lMemFence();
     }
 
     void Launch(int baseIndex, int count);
     void Sync();
 
+    /** Task group of the task that was running on the current thread when
+        this group was allocated, or NULL if the group was allocated
+        outside of any task.  Task groups thus form a tree that mirrors
+        the nesting of launches. */
+    TaskGroup *parent;
+
+    /** The group at the top of this group's tree (the one with no
+        parent), and the number of groups between here and there; these
+        let IsInSubtreeOf() reject unrelated groups without walking up
+        the tree. */
+    TaskGroup *root;
+    int depth;
+
+    /** Returns true if this group is the given group or was (transitively)
+        launched from one of its tasks. */
+    bool IsInSubtreeOf(const TaskGroup *tg) const {
+        if (root != tg->root || depth < tg->depth)
+            return false;
+        const TaskGroup *g = this;
+        for (int i = depth; i > tg->depth; --i)
+            g = g->parent;
+        return g == tg;
+    }
+
 private:
     friend void *lTaskEntry(void *arg);
 
@@ -516,6 +861,9 @@ private:
 static dispatch_queue_t gcdQueue;
 static volatile int32_t lock = 0;
 
+// The task group of the task that the current thread is running, if any.
+static ISPC_THREAD_LOCAL TaskGroup *currentTaskGroup = NULL;
+
 static void
 InitTaskSystem() {
     if (gcdQueue != NULL)
@@ -544,18 +892,28 @@ lRunTask(void *ti) {
     int threadCount = 1;
 
     // Actually run the task
+    TaskGroup *savedTaskGroup = currentTaskGroup;
+    currentTaskGroup = taskInfo->taskGroup;
     taskInfo->func(taskInfo->data, threadIndex, threadCount, 
                    taskInfo->taskIndex, taskInfo->taskCount(),
             taskInfo->taskIndex0(), taskInfo->taskIndex1(), taskInfo->taskIndex2(),
             taskInfo->taskCount0(), taskInfo->taskCount1(), taskInfo->taskCount2());
+    currentTaskGroup = savedTaskGroup;
 }
 
 
 inline void
 TaskGroup::Launch(int baseIndex, int count) {
+    dispatch_queue_t queue = gcdQueue;
+    if (priority > 0)
+        queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
+    else if (priority < 0)
+        queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0);
+
     for (int i = 0; i < count; ++i) {
         TaskInfo *ti = GetTaskInfo(baseIndex + i);
-        dispatch_group_async_f(gcdGroup, gcdQueue, ti, lRunTask);
+        ti->taskGroup = this;
+        dispatch_group_async_f(gcdGroup, queue, ti, lRunTask);
     }
 }
 
@@ -572,9 +930,34 @@ TaskGroup::Sync() {
 
 #ifdef ISPC_USE_CONCRT
 
+static volatile int32_t lock = 0;
+static bool schedulerInitialized = false;
+
 static void
 InitTaskSystem() {
-    // No initialization needed
+    if (schedulerInitialized)
+        return;
+
+    while (1) {
+        if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+            if (!schedulerInitialized) {
+                lInitThreadConfig();
+                try {
+                    SchedulerPolicy policy(2, MinConcurrency, 1,
+                                           MaxConcurrency, configNumThreads);
+                    Scheduler::SetDefaultSchedulerPolicy(policy);
+                }
+                catch (default_scheduler_exists &) {
+                    // The application has already started using ConcRT;
+                    // leave its scheduler alone.
+                }
+                lMemFence();
+                schedulerInitialized = true;
+            }
+            lock = 0;
+            break;
+        }
+    }
 }
 
 
@@ -625,15 +1008,84 @@ static volatile int32_t lock = 0;
 static int nThreads;
 static pthread_t *threads = NULL;
 
+/** Orders (priority, deadline) pairs so that the ones whose tasks should
+    run first come first. */
+struct TaskGroupUrgencyOrder {
+    bool operator()(const std::pair<int, int64_t> &a,
+                    const std::pair<int, int64_t> &b) const {
+        return lRunsBefore(a.first, a.second, b.first, b.second);
+    }
+};
+
+/* Task groups with tasks waiting to be run, bucketed by their priority
+   and deadline, most urgent first.  Within a bucket, the most recently
+   activated group is at the back.  The bucket for the default priority
+   is kept around even when it's empty, so that the common case doesn't
+   allocate. */
+typedef std::map<std::pair<int, int64_t>, std::vector<TaskGroup *>,
+                 TaskGroupUrgencyOrder> TaskGroupBuckets;
+
 static pthread_mutex_t taskSysMutex;
-static std::vector<TaskGroup *> activeTaskGroups;
+static TaskGroupBuckets activeTaskGroups;
 static sem_t *workerSemaphore;
 
+// The task group of the task that the current thread is running, if any.
+static ISPC_THREAD_LOCAL TaskGroup *currentTaskGroup = NULL;
+
+/** Adds the given group to activeTaskGroups.  Must be called with
+    taskSysMutex held. */
+static void
+lAddActiveTaskGroup(TaskGroup *tg) {
+    activeTaskGroups[std::make_pair(tg->priority, tg->deadline)].push_back(tg);
+}
+
+/** Removes the given group from activeTaskGroups.  Must be called with
+    taskSysMutex held. */
+static void
+lRemoveActiveTaskGroup(TaskGroup *tg) {
+    TaskGroupBuckets::iterator iter =
+        activeTaskGroups.find(std::make_pair(tg->priority, tg->deadline));
+    assert(iter != activeTaskGroups.end());
+    std::vector<TaskGroup *> &bucket = iter->second;
+    if (bucket.back() == tg)
+        bucket.pop_back();
+    else
+        bucket.erase(std::find(bucket.begin(), bucket.end(), tg));
+    if (bucket.size() == 0 && (tg->priority != 0 || tg->deadline != 0))
+        activeTaskGroups.erase(iter);
+}
+
+/** Returns the active group to run the next task from, or NULL if there
+    isn't one.  Higher priority groups are run first, then ones with
+    earlier deadlines; otherwise we take the most recently activated
+    group.  If subtreeRoot is non-NULL, only groups in its subtree are
+    considered.  Must be called with taskSysMutex held.
+ */
+static TaskGroup *
+lPickTaskGroup(const TaskGroup *subtreeRoot) {
+    TaskGroupBuckets::iterator iter;
+    for (iter = activeTaskGroups.begin(); iter != activeTaskGroups.end(); ++iter) {
+        const std::vector<TaskGroup *> &bucket = iter->second;
+        if (bucket.size() == 0)
+            continue;
+        if (subtreeRoot == NULL)
+            return bucket.back();
+        for (int i = (int)bucket.size() - 1; i >= 0; --i)
+            if (bucket[i]->IsInSubtreeOf(subtreeRoot))
+                return bucket[i];
+    }
+    return NULL;
+}
+
 static void *
 lTaskEntry(void *arg) {
     int threadIndex = (int)((int64_t)arg);
     int threadCount = nThreads;
 
+    // Slot 0 of the affinity list is left for the thread that calls into
+    // ispc code.
+    lPinCurrentThread(threadIndex + 1);
+
     while (1) {
         int err;
         //
@@ -653,7 +1105,12 @@ lTaskEntry(void *arg) {
             exit(1);
         }
 
-        if (activeTaskGroups.size() == 0) {
+        //
+        // Get the most urgent task group on the active list and the last
+        // task from its waiting tasks list.
+        //
+        TaskGroup *tg = lPickTaskGroup(NULL);
+        if (tg == NULL) {
             //
             // Task queue is empty, go back and wait on the semaphore
             //
@@ -664,11 +1121,6 @@ lTaskEntry(void *arg) {
             continue;
         }
 
-        //
-        // Get the last task group on the active list and the last task
-        // from its waiting tasks list.
-        //
-        TaskGroup *tg = activeTaskGroups.back();
         assert(tg->waitingTasks.size() > 0);
         int taskNumber = tg->waitingTasks.back();
         tg->waitingTasks.pop_back();
@@ -676,7 +1128,7 @@ lTaskEntry(void *arg) {
         if (tg->waitingTasks.size() == 0) {
             // We just took the last task from this task group, so remove
             // it from the active list.
-            activeTaskGroups.pop_back();
+            lRemoveActiveTaskGroup(tg);
             tg->inActiveList = false;
         }
     
@@ -690,10 +1142,12 @@ lTaskEntry(void *arg) {
         //
         DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
         TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
+        currentTaskGroup = tg;
         myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
                      myTask->taskCount(),
             myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
             myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+        currentTaskGroup = NULL;
 
         //
         // Decrement the "number of unfinished tasks" counter in the task
@@ -717,7 +1171,8 @@ InitTaskSystem() {
                     // We launch one fewer thread than there are cores,
                     // since the main thread here will also grab jobs from
                     // the task queue itself.
-                    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+                    lInitThreadConfig();
+                    nThreads = configNumThreads - 1;
 
                     int err;
                     if ((err = pthread_mutex_init(&taskSysMutex, NULL)) != 0) {
@@ -752,7 +1207,7 @@ InitTaskSystem() {
                         }
                     }
 
-                    activeTaskGroups.reserve(64);
+                    activeTaskGroups[std::make_pair(0, (int64_t)0)].reserve(64);
                 }
 
                 // Make sure all of the above goes to memory before we
@@ -790,7 +1245,7 @@ TaskGroup::Launch(int baseCoord, int count) {
     // Add the task group to the global active list if it isn't there
     // already.
     if (inActiveList == false) {
-        activeTaskGroups.push_back(this);
+        lAddActiveTaskGroup(this);
         inActiveList = true;
     }
 
@@ -847,8 +1302,7 @@ TaskGroup::Sync() {
             if (waitingTasks.size() == 0) {
                 // There's nothing left to start running from this group,
                 // so remove it from the active task list.
-                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
-                                                 activeTaskGroups.end(), this));
+                lRemoveActiveTaskGroup(this);
                 inActiveList = false;
             }
             myTask = GetTaskInfo(taskNumber);
@@ -857,10 +1311,16 @@ TaskGroup::Sync() {
         else {
             // Other threads are already working on all of the tasks in
             // this group, so we can't help out by running one ourself.
-            // We'll try to run one from another group to make ourselves
-            // useful here.
-            if (activeTaskGroups.size() == 0) {
-                // No active task groups left--there's nothing for us to do.
+            // We'll try to run one that was launched (directly or not)
+            // by one of those tasks, since it has to finish before this
+            // group can.  Tasks from unrelated groups are left alone: we
+            // could end up stuck running a long one after our own tasks
+            // have finished, and the stack would grow with every level
+            // of nesting of unrelated work.
+            runtg = lPickTaskGroup(this);
+            if (runtg == NULL) {
+                // No active task groups from this group's subtree--there's
+                // nothing for us to do.
                 if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
                     fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
                     exit(1);
@@ -878,8 +1338,7 @@ TaskGroup::Sync() {
                 continue;
             }
 
-            // Get a task to run from another task group.
-            runtg = activeTaskGroups.back();
+            // Get a task to run from the descendant task group.
             assert(runtg->waitingTasks.size() > 0);
 
             int taskNumber = runtg->waitingTasks.back();
@@ -887,11 +1346,11 @@ TaskGroup::Sync() {
             if (runtg->waitingTasks.size() == 0) {
                 // There's left to start running from this group, so remove
                 // it from the active task list.
-                activeTaskGroups.pop_back();
+                lRemoveActiveTaskGroup(runtg);
                 runtg->inActiveList = false;
             }
             myTask = runtg->GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from other group %p in sync\n", 
+            DBG(fprintf(stderr, "running task %d from descendant group %p in sync\n",
                         taskNumber, runtg));
         }
 
@@ -904,9 +1363,12 @@ TaskGroup::Sync() {
         // Do work for _myTask_
         //
         // FIXME: bogus values for thread index/thread count here as well..
+        TaskGroup *savedTaskGroup = currentTaskGroup;
+        currentTaskGroup = runtg;
         myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(),
             myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
             myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+        currentTaskGroup = savedTaskGroup;
 
         //
         // Decrement the number of unfinished tasks counter
@@ -924,9 +1386,30 @@ TaskGroup::Sync() {
 
 #ifdef ISPC_USE_CILK
 
+static volatile int32_t lock = 0;
+static bool workersInitialized = false;
+
 static void
 InitTaskSystem() {
-    // No initialization needed
+    if (workersInitialized)
+        return;
+
+    while (1) {
+        if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+            if (!workersInitialized) {
+                // Note that this only has an effect if the Cilk runtime
+                // hasn't started up yet.
+                lInitThreadConfig();
+                char nWorkers[16];
+                sprintf(nWorkers, "%d", configNumThreads);
+                __cilkrts_set_param("nworkers", nWorkers);
+                lMemFence();
+                workersInitialized = true;
+            }
+            lock = 0;
+            break;
+        }
+    }
 }
 
 inline void
@@ -953,14 +1436,39 @@ TaskGroup::Sync() {
 
 #ifdef ISPC_USE_OMP
 
+static volatile int32_t lock = 0;
+static bool threadsInitialized = false;
+
 static void
 InitTaskSystem() {
-        // No initialization needed
+    if (threadsInitialized)
+        return;
+
+    while (1) {
+        if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+            if (!threadsInitialized) {
+                lInitThreadConfig();
+                // The OpenMP runtime keeps the same threads around for
+                // later parallel regions, so it's enough to pin them once
+                // here.  Thread 0 is the calling thread, which we leave
+                // alone.
+#pragma omp parallel num_threads(configNumThreads)
+                {
+                    if (omp_get_thread_num() != 0)
+                        lPinCurrentThread(omp_get_thread_num());
+                }
+                lMemFence();
+                threadsInitialized = true;
+            }
+            lock = 0;
+            break;
+        }
+    }
 }
 
 inline void
 TaskGroup::Launch(int baseIndex, int count) {
-#pragma omp parallel
+#pragma omp parallel num_threads(configNumThreads)
   {
     const int threadIndex = omp_get_thread_num();
     const int threadCount = omp_get_num_threads();
@@ -987,16 +1495,58 @@ TaskGroup::Sync() {
 ///////////////////////////////////////////////////////////////////////////
 // Thread Building Blocks
 
-#ifdef ISPC_USE_TBB_PARALLEL_FOR
+#if defined(ISPC_USE_TBB_PARALLEL_FOR) || defined(ISPC_USE_TBB_TASK_GROUP)
+
+/* All tasks are run in a TBB arena whose concurrency is the configured
+   number of threads; an observer pins the arena's worker threads as they
+   join it. */
+class PinningObserver : public tbb::task_scheduler_observer {
+public:
+    PinningObserver() : nextSlot(0) { }
+
+    void on_scheduler_entry(bool isWorker) {
+        if (isWorker)
+            lPinCurrentThread(1 + lAtomicAdd(&nextSlot, 1));
+    }
+
+private:
+    volatile int32_t nextSlot;
+};
+
+static volatile int32_t lock = 0;
+static tbb::task_arena *tbbArena = NULL;
+static PinningObserver *pinningObserver = NULL;
 
 static void
 InitTaskSystem() {
-    // No initialization needed by default
-    //tbb::task_scheduler_init();
+    if (tbbArena != NULL)
+        return;
+
+    while (1) {
+        if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+            if (tbbArena == NULL) {
+                lInitThreadConfig();
+                if (configNumAffinityCPUs > 0) {
+                    pinningObserver = new PinningObserver;
+                    pinningObserver->observe(true);
+                }
+                tbb::task_arena *arena = new tbb::task_arena(configNumThreads);
+                lMemFence();
+                tbbArena = arena;
+            }
+            lock = 0;
+            break;
+        }
+    }
 }
 
+#endif // ISPC_USE_TBB_PARALLEL_FOR || ISPC_USE_TBB_TASK_GROUP
+
+#ifdef ISPC_USE_TBB_PARALLEL_FOR
+
 inline void
 TaskGroup::Launch(int baseIndex, int count) {
+  tbbArena->execute([=]() {
     tbb::parallel_for(0, count, [=](int i) {
         TaskInfo *ti = GetTaskInfo(baseIndex + i);
 
@@ -1009,6 +1559,7 @@ TaskGroup::Launch(int baseIndex, int count) {
             ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
     });
+  });
 }
 
 inline void
@@ -1019,14 +1570,9 @@ TaskGroup::Sync() {
 
 #ifdef ISPC_USE_TBB_TASK_GROUP
 
-static void
-InitTaskSystem() {
-    // No initialization needed by default
-    //tbb::task_scheduler_init();
-}
-
 inline void
 TaskGroup::Launch(int baseIndex, int count) {
+  tbbArena->execute([=]() {
     for (int i = 0; i < count; i++) {
         tbbTaskGroup.run([=]() {
             TaskInfo *ti = GetTaskInfo(baseIndex + i);
@@ -1039,11 +1585,12 @@ TaskGroup::Launch(int baseIndex, int count) {
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
         });
     }
+  });
 }
 
 inline void
 TaskGroup::Sync() {
-    tbbTaskGroup.wait();
+    tbbArena->execute([this]() { tbbTaskGroup.wait(); });
 }
 
 #endif // ISPC_USE_TBB_TASK_GROUP
@@ -1052,22 +1599,56 @@ TaskGroup::Sync() {
 
 #ifndef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 
+/* Free task groups are first kept in a small per-thread cache: the
+   function that syncs a task group runs on the same thread that allocated
+   it, so in the common case a group is recycled without any atomics.
+   Groups that don't fit in the cache go to a global pool shared by all
+   threads.  (Groups left in the cache of a thread when it exits are
+   leaked; the cache is small enough that this doesn't matter much.)
+ */
+#define TASK_GROUP_CACHE_SIZE 4
+static ISPC_THREAD_LOCAL TaskGroup *threadTaskGroupCache[TASK_GROUP_CACHE_SIZE];
+static ISPC_THREAD_LOCAL int threadTaskGroupCacheCount;
+
 #define MAX_FREE_TASK_GROUPS 64
 static TaskGroup *freeTaskGroups[MAX_FREE_TASK_GROUPS];
 
 static inline TaskGroup *
 AllocTaskGroup() {
-    for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
+    TaskGroup *taskGroup = NULL;
+    if (threadTaskGroupCacheCount > 0)
+        taskGroup = threadTaskGroupCache[--threadTaskGroupCacheCount];
+
+    for (int i = 0; i < MAX_FREE_TASK_GROUPS && taskGroup == NULL; ++i) {
         TaskGroup *tg = freeTaskGroups[i];
         if (tg != NULL) {
             void *ptr = lAtomicCompareAndSwapPointer((void **)(&freeTaskGroups[i]), NULL, tg);
-            if (ptr != NULL) {
-                return (TaskGroup *)ptr;
-            }
+            if (ptr != NULL)
+                taskGroup = (TaskGroup *)ptr;
         }
     }
 
-    return new TaskGroup;
+    if (taskGroup == NULL)
+        taskGroup = new TaskGroup;
+    taskGroup->priority = launchPriority;
+    taskGroup->deadline = launchDeadline;
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_GCD)
+    if (currentTaskGroup != NULL) {
+        // Nested launches inherit the urgency of their parent.
+        taskGroup->priority = currentTaskGroup->priority;
+        taskGroup->deadline = currentTaskGroup->deadline;
+    }
+#endif // ISPC_USE_PTHREADS || ISPC_USE_GCD
+#ifdef ISPC_USE_PTHREADS
+    taskGroup->parent = currentTaskGroup;
+    if (currentTaskGroup != NULL) {
+        taskGroup->root = currentTaskGroup->root;
+        taskGroup->depth = currentTaskGroup->depth + 1;
+    }
+    else
+        taskGroup->root = taskGroup;
+#endif // ISPC_USE_PTHREADS
+    return taskGroup;
 }
 
 
@@ -1075,6 +1656,11 @@ static inline void
 FreeTaskGroup(TaskGroup *tg) {
     tg->Reset();
 
+    if (threadTaskGroupCacheCount < TASK_GROUP_CACHE_SIZE) {
+        threadTaskGroupCache[threadTaskGroupCacheCount++] = tg;
+        return;
+    }
+
     for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
         if (freeTaskGroups[i] == NULL) {
             void *ptr = lAtomicCompareAndSwapPointer((void **)&freeTaskGroups[i], tg, NULL);
@@ -1325,9 +1911,13 @@ void *_threadFct(void *data) {
 void TaskSys::createThreads() 
 {
     init();
-    int reserved = 4;
+    lInitThreadConfig();
+    // By default, leave a few hardware threads free for the OS (on KNC,
+    // it runs on the first core); an explicit ISPC_NUM_THREADS is taken
+    // as is, less one for the thread calling into ispc code.
+    int reserved = configNumThreadsFromEnv ? 1 : 4;
     int minid = 2;
-    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - reserved;
+    nThreads = std::max(1, configNumThreads - reserved);
 
     thread = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
 
@@ -1337,7 +1927,8 @@ void TaskSys::createThreads()
         pthread_attr_init(&attr);
         pthread_attr_setstacksize(&attr, 2*1024 * 1024);
 
-        int threadID = minid+i;
+        int threadID = (configNumAffinityCPUs > 0) ?
+            configAffinityCPUs[(i + 1) % configNumAffinityCPUs] : minid+i;
         cpu_set_t cpuset;
         CPU_ZERO(&cpuset);
         CPU_SET(threadID,&cpuset);
@@ -46,6 +46,7 @@
 #include "util.h"
 #include "profile/profile_region_types.h"
 #include <stdio.h>
+#include <string.h>
 
 #if defined(LLVM_3_2)
 #ifdef ISPC_NVPTX_ENABLED
@@ -75,6 +76,7 @@
 #endif
 #include <llvm/PassRegistry.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Support/FormattedStream.h>
 #include <llvm/Support/FileUtilities.h>
 #include <llvm/Target/TargetMachine.h>
@@ -90,15 +92,156 @@
 #endif
 #include <llvm/Support/ToolOutputFile.h>
 
+struct AutoSOAInfo {
+    /** Local arrays that could be converted to SOA layout, as far as
+        their declarations go. */
+    std::vector<Symbol *> candidates;
+    /** Number of references to each symbol in the function body. */
+    std::map<Symbol *, int> uses;
+    /** Number of references to each symbol that are of the form
+        "sym[index].member". */
+    std::map<Symbol *, int> memberUses;
+    /** Symbols whose address (or the address of one of their elements)
+        may be taken, directly or by passing them to a function. */
+    std::set<Symbol *> escaped;
+};
+
+
+/** Returns true if the given symbol is a local array of uniform structs
+    that could be declared as an array of soa<width> structs instead. */
+static bool
+lIsAutoSOACandidate(Symbol *sym, Expr *init) {
+    if (sym == NULL || init != NULL || sym->storageClass == SC_STATIC)
+        return false;
+
+    const ArrayType *at = CastType<ArrayType>(sym->type);
+    if (at == NULL || at->GetElementCount() == 0)
+        return false;
+
+    const StructType *st = CastType<StructType>(at->GetElementType());
+    if (st == NULL || st->IsUniformType() == false || st->IsConstType())
+        return false;
+
+    // Only handle structs with members of basic types that don't have an
+    // explicit rate qualifier (which is illegal with soa<>).
+    for (int i = 0; i < st->GetElementCount(); ++i) {
+        const Type *eltType = st->GetRawElementType(i);
+        if (eltType == NULL ||
+            (CastType<AtomicType>(eltType) == NULL &&
+             CastType<EnumType>(eltType) == NULL) ||
+            eltType->HasUnboundVariability() == false)
+            return false;
+    }
+    return true;
+}
+
+
+static bool
+lAutoSOAPreFunc(ASTNode *node, void *d) {
+    AutoSOAInfo *info = (AutoSOAInfo *)d;
+
+    DeclStmt *ds = dynamic_cast<DeclStmt *>(node);
+    if (ds != NULL) {
+        for (unsigned int i = 0; i < ds->vars.size(); ++i)
+            if (lIsAutoSOACandidate(ds->vars[i].sym, ds->vars[i].init))
+                info->candidates.push_back(ds->vars[i].sym);
+        return true;
+    }
+
+    SymbolExpr *se = dynamic_cast<SymbolExpr *>(node);
+    if (se != NULL) {
+        ++info->uses[se->GetBaseSymbol()];
+        return true;
+    }
+
+    MemberExpr *me = dynamic_cast<MemberExpr *>(node);
+    if (me != NULL) {
+        IndexExpr *ie = dynamic_cast<IndexExpr *>(me->expr);
+        if (me->dereferenceExpr == false && ie != NULL &&
+            dynamic_cast<SymbolExpr *>(ie->baseExpr) != NULL)
+            ++info->memberUses[ie->baseExpr->GetBaseSymbol()];
+        return true;
+    }
+
+    AddressOfExpr *ae = dynamic_cast<AddressOfExpr *>(node);
+    if (ae != NULL && ae->expr != NULL) {
+        info->escaped.insert(ae->expr->GetBaseSymbol());
+        return true;
+    }
+
+    SizeOfExpr *soe = dynamic_cast<SizeOfExpr *>(node);
+    if (soe != NULL && soe->expr != NULL) {
+        info->escaped.insert(soe->expr->GetBaseSymbol());
+        return true;
+    }
+
+    // Arguments to function calls may be bound to reference parameters.
+    FunctionCallExpr *fce = dynamic_cast<FunctionCallExpr *>(node);
+    if (fce != NULL && fce->args != NULL) {
+        for (unsigned int i = 0; i < fce->args->exprs.size(); ++i)
+            if (fce->args->exprs[i] != NULL)
+                info->escaped.insert(fce->args->exprs[i]->GetBaseSymbol());
+        return true;
+    }
+
+    return true;
+}
+
+
+/** With --opt=auto-soa, local arrays of uniform structs whose elements
+    are only ever accessed one member at a time ("a[i].x"), and whose
+    address is never taken, are given soa<gang size> layout, so that
+    accesses with indices that are consecutive across the program
+    instances become vector loads and stores rather than gathers and
+    scatters.  The existing SOA indexing support makes this transparent
+    to the rest of the function; this must run before the function body
+    is type checked.
+ */
+static void
+lConvertLocalArraysToSOA(Stmt *code) {
+    int width = g->target->getVectorWidth();
+    if (width == 1)
+        return;
+#ifdef ISPC_NVPTX_ENABLED
+    if (g->target->getISA() == Target::NVPTX)
+        return;
+#endif /* ISPC_NVPTX_ENABLED */
+
+    AutoSOAInfo info;
+    WalkAST(code, lAutoSOAPreFunc, NULL, &info);
+
+    for (unsigned int i = 0; i < info.candidates.size(); ++i) {
+        Symbol *sym = info.candidates[i];
+        if (info.uses[sym] == 0 || info.uses[sym] != info.memberUses[sym] ||
+            info.escaped.find(sym) != info.escaped.end())
+            continue;
+
+        const ArrayType *at = CastType<ArrayType>(sym->type);
+        const StructType *st = CastType<StructType>(at->GetElementType());
+        int count = (at->GetElementCount() + width - 1) / width;
+        sym->type = new ArrayType(st->GetAsSOAType(width), count);
+        Debug(sym->pos, "Converted local array \"%s\" to soa<%d> layout.",
+              sym->name.c_str(), width);
+    }
+}
+
+
 Function::Function(Symbol *s, Stmt *c) {
     sym = s;
     code = c;
+    isStdlib = m->parsingStdlib;
 
     maskSymbol = m->symbolTable->LookupVariable("__mask");
     Assert(maskSymbol != NULL);
 
     if (code != NULL) {
-        code = TypeCheck(code);
+        if (g->opt.autoSOA)
+            lConvertLocalArraysToSOA(code);
+
+        {
+            StatsTimer timer("TypeCheck", sym->name);
+            code = TypeCheck(code);
+        }
 
         if (code != NULL && g->debugPrint) {
             printf("After typechecking function \"%s\":\n",
@@ -108,7 +251,10 @@ Function::Function(Symbol *s, Stmt *c) {
         }
 
         if (code != NULL) {
-            code = Optimize(code);
+            {
+                StatsTimer timer("Optimize", sym->name);
+                code = Optimize(code);
+            }
             if (g->debugPrint) {
                 printf("After optimizing function \"%s\":\n",
                         sym->name.c_str());
@@ -241,6 +387,8 @@ lCopyInTaskParameter(int i, llvm::Value *structArgPtr, const
 void
 Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
                    SourcePos firstStmtPos) {
+    StatsTimer timer("EmitCode", sym->name);
+
     // Connect the __mask builtin to the location in memory that stores its
     // value
     maskSymbol->storagePtr = ctx->GetFullMaskPointer();
@@ -347,6 +495,16 @@ Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
             Assert(type->isUnmasked || type->isExported);
             ctx->SetFunctionMask(LLVMMaskAllOn);
         }
+        else if (ctx->GetAsyncLaunchHandlePtr() != NULL) {
+            // The asynchronous variant of an exported function takes the
+            // pointer through which the launch group handle is returned
+            // as its last parameter, after the declared ones.
+            Assert(type->isExported);
+            Assert(ctx->GetAsyncLaunchHandlePtr() == &*argIter);
+            argIter->setName("__ispc_handlePtr");
+            ctx->SetFunctionMask(LLVMMaskAllOn);
+            Assert(++argIter == function->arg_end());
+        }
         else {
             Assert(type->isUnmasked == false);
 
@@ -472,6 +630,312 @@ Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
 }
 
 
+/** Returns the name to use for the application-callable version of the
+    given exported function, adding the target ISA to it if we're
+    compiling to multiple targets.
+ */
+static std::string
+lExportedFunctionName(const std::string &name) {
+    std::string functionName = name;
+    if (g->mangleFunctionsWithTarget) {
+        // If we treat generic as smth, we should have appropriate mangling
+        if (g->target->getISA() == Target::GENERIC &&
+            !g->target->getTreatGenericAsSmth().empty())
+            functionName += std::string("_") + g->target->getTreatGenericAsSmth();
+        else
+            functionName += std::string("_") + g->target->GetISAString();
+    }
+    return functionName;
+}
+
+
+static bool
+lIsLaunchCheck(ASTNode *node, void *data) {
+    FunctionCallExpr *fce = dynamic_cast<FunctionCallExpr *>(node);
+    if (fce != NULL && fce->isLaunch)
+        *(bool *)data = true;
+    return true;
+}
+
+
+/** Returns true if the given code contains a 'launch' statement.
+ */
+static bool
+lContainsLaunch(Stmt *code) {
+    bool containsLaunch = false;
+    WalkAST(code, lIsLaunchCheck, NULL, &containsLaunch);
+    return containsLaunch;
+}
+
+
+static bool
+lStaticLocalCheck(ASTNode *node, void *data) {
+    const Symbol **staticSym = (const Symbol **)data;
+    if (*staticSym != NULL)
+        return false;
+
+    DeclStmt *ds = dynamic_cast<DeclStmt *>(node);
+    if (ds != NULL) {
+        for (unsigned int i = 0; i < ds->vars.size(); ++i) {
+            Symbol *sym = ds->vars[i].sym;
+            if (sym != NULL && sym->storageClass == SC_STATIC) {
+                *staticSym = sym;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+/** Returns the first "static" local variable declared in the given code,
+    or NULL if there isn't one.
+ */
+static const Symbol *
+lFindStaticLocal(Stmt *code) {
+    const Symbol *staticSym = NULL;
+    WalkAST(code, lStaticLocalCheck, NULL, &staticSym);
+    return staticSym;
+}
+
+
+/** The largest number of specialized versions of a single exported
+    function that we'll generate. */
+static const int lMaxSpecializations = 64;
+
+/** Adds a call to the given function with the given arguments to the end
+    of the basic block, followed by a return of its result. */
+static void
+lEmitCallAndReturn(llvm::BasicBlock *bblock, llvm::Function *callee,
+                   const std::vector<llvm::Value *> &args) {
+    llvm::CallInst *call = llvm::CallInst::Create(callee, args, "", bblock);
+    if (callee->getReturnType()->isVoidTy())
+        llvm::ReturnInst::Create(*g->ctx, bblock);
+    else
+        llvm::ReturnInst::Create(*g->ctx, call, bblock);
+}
+
+
+/** For an exported function with parameters that have a
+    __declspec(specialize(...)) annotation, this makes a copy of the
+    application-callable function for each combination of the given
+    parameter values, where those parameters are replaced with constants,
+    so that the optimizer can fold them into the function's code.  The
+    application-callable function itself is then replaced with one that
+    checks the parameters' values and calls the matching copy, or a copy
+    of the original function if there isn't one.
+ */
+static void
+lSpecializeExportedFunction(llvm::Function *function, const FunctionType *type,
+                            SourcePos pos) {
+    const std::vector<std::pair<int, std::vector<int64_t> > > &specs =
+        type->specializations;
+
+    int numVariants = 1;
+    for (unsigned int i = 0; i < specs.size(); ++i) {
+        numVariants *= (int)specs[i].second.size();
+        if (numVariants > lMaxSpecializations) {
+            Warning(pos, "Not specializing function \"%s\" since more than %d "
+                    "versions of it would be needed.",
+                    function->getName().str().c_str(), lMaxSpecializations);
+            return;
+        }
+    }
+
+    std::vector<llvm::Argument *> args;
+    for (llvm::Function::arg_iterator iter = function->arg_begin();
+         iter != function->arg_end(); ++iter)
+        args.push_back(&*iter);
+
+    // Make all of the copies before the original function's body is
+    // replaced.
+    llvm::ValueToValueMapTy genericMap;
+    llvm::Function *generic = llvm::CloneFunction(function, genericMap, false);
+    generic->setName(function->getName().str() + "___generic");
+    generic->setLinkage(llvm::GlobalValue::InternalLinkage);
+    m->module->getFunctionList().push_back(generic);
+
+    std::vector<llvm::Function *> variants;
+    std::vector<std::vector<llvm::Constant *> > variantValues;
+    std::vector<unsigned int> valueIndex(specs.size(), 0);
+    for (int v = 0; v < numVariants; ++v) {
+        llvm::ValueToValueMapTy valueMap;
+        std::vector<llvm::Constant *> values;
+        std::string name = function->getName().str() + "___spec";
+        for (unsigned int i = 0; i < specs.size(); ++i) {
+            llvm::Argument *arg = args[specs[i].first];
+            int64_t value = specs[i].second[valueIndex[i]];
+            llvm::Constant *c =
+                llvm::ConstantInt::get(arg->getType(), (uint64_t)value, true);
+            valueMap[arg] = c;
+            values.push_back(c);
+
+            char buf[32];
+            sprintf(buf, "_%lld", (long long)value);
+            name += buf;
+        }
+
+        // The parameters in valueMap are dropped from the copy's
+        // signature.
+        llvm::Function *variant = llvm::CloneFunction(function, valueMap, false);
+        variant->setName(name);
+        variant->setLinkage(llvm::GlobalValue::InternalLinkage);
+        m->module->getFunctionList().push_back(variant);
+        variants.push_back(variant);
+        variantValues.push_back(values);
+
+        // Advance to the next combination of parameter values.
+        for (int i = (int)specs.size() - 1; i >= 0; --i) {
+            if (++valueIndex[i] < specs[i].second.size())
+                break;
+            valueIndex[i] = 0;
+        }
+    }
+
+    function->deleteBody();
+    llvm::BasicBlock *bblock =
+        llvm::BasicBlock::Create(*g->ctx, "entry", function);
+    for (unsigned int v = 0; v < variants.size(); ++v) {
+        llvm::Value *test = NULL;
+        for (unsigned int i = 0; i < specs.size(); ++i) {
+            llvm::Value *cmp =
+                new llvm::ICmpInst(*bblock, llvm::CmpInst::ICMP_EQ,
+                                   args[specs[i].first], variantValues[v][i],
+                                   "specialize_test");
+            test = (test == NULL) ? cmp :
+                llvm::BinaryOperator::Create(llvm::Instruction::And, test, cmp,
+                                             "specialize_test", bblock);
+        }
+
+        llvm::BasicBlock *callBlock =
+            llvm::BasicBlock::Create(*g->ctx, "call_specialized", function);
+        llvm::BasicBlock *nextBlock =
+            llvm::BasicBlock::Create(*g->ctx, "next_test", function);
+        llvm::BranchInst::Create(callBlock, nextBlock, test, bblock);
+
+        std::vector<llvm::Value *> callArgs;
+        for (unsigned int a = 0; a < args.size(); ++a) {
+            bool isSpecialized = false;
+            for (unsigned int i = 0; i < specs.size(); ++i)
+                if (specs[i].first == (int)a)
+                    isSpecialized = true;
+            if (!isSpecialized)
+                callArgs.push_back(args[a]);
+        }
+        lEmitCallAndReturn(callBlock, variants[v], callArgs);
+
+        bblock = nextBlock;
+    }
+
+    std::vector<llvm::Value *> callArgs(args.begin(), args.end());
+    lEmitCallAndReturn(bblock, generic, callArgs);
+}
+
+
+/** For exported functions declared with __declspec(async), we emit a
+    second application-callable version, "<name>_async", that takes an
+    additional "void **__ispc_handlePtr" parameter.  Rather than waiting for the
+    launched tasks to finish, it returns as soon as its own code is done
+    and stores the handle to the group of tasks it launched in
+    *__ispc_handlePtr; the caller then passes that handle to ISPCSync() when it
+    needs the results.  A symbol for the variant is added to the symbol
+    table so that it is included in the generated header and dispatch
+    functions like any other exported function.
+ */
+void
+Function::generateAsyncExportedIR(SourcePos firstStmtPos) {
+    const FunctionType *type = CastType<FunctionType>(sym->type);
+    Assert(type != NULL && type->isExported && !type->isTask);
+
+    std::string asyncName = sym->name + "_async";
+    if (m->symbolTable->LookupFunction(asyncName.c_str())) {
+        Warning(sym->pos, "Not emitting asynchronous variant of exported "
+                "function \"%s\", since a function named \"%s\" is "
+                "already defined.", sym->name.c_str(), asyncName.c_str());
+        return;
+    }
+
+    llvm::SmallVector<const Type *, 8> argTypes;
+    llvm::SmallVector<std::string, 8> argNames;
+    llvm::SmallVector<Expr *, 8> argDefaults;
+    llvm::SmallVector<SourcePos, 8> argPos;
+    for (int i = 0; i < type->GetNumParameters(); ++i) {
+        argTypes.push_back(type->GetParameterType(i));
+        argNames.push_back(type->GetParameterName(i));
+        argDefaults.push_back(type->GetParameterDefault(i));
+        argPos.push_back(type->GetParameterSourcePos(i));
+    }
+    argTypes.push_back(PointerType::GetUniform(PointerType::Void));
+    argNames.push_back("__ispc_handlePtr");
+    argDefaults.push_back(NULL);
+    argPos.push_back(sym->pos);
+    const FunctionType *asyncType =
+        new FunctionType(type->GetReturnType(), argTypes, argNames, argDefaults,
+                         argPos, false /* isTask */, true /* isExported */,
+                         false /* isExternC */, type->isUnmasked);
+
+    std::string functionName = lExportedFunctionName(asyncName);
+    llvm::FunctionType *ftype = asyncType->LLVMFunctionType(g->ctx, true);
+    llvm::Function *asyncFunction =
+        llvm::Function::Create(ftype, llvm::GlobalValue::ExternalLinkage,
+                               functionName.c_str(), m->module);
+    asyncFunction->setDoesNotThrow();
+    for (int i = 1; i < sym->function->getFunctionType()->getNumParams(); i++) {
+        if (sym->function->doesNotAlias(i)) {
+            asyncFunction->setDoesNotAlias(i);
+        }
+    }
+    g->target->markFuncWithTargetAttr(asyncFunction);
+
+    if (asyncFunction->getName() != functionName) {
+        // Some other global already has this name; the error for that
+        // will be issued elsewhere.
+        asyncFunction->eraseFromParent();
+        return;
+    }
+
+    llvm::Function::arg_iterator handleArg = asyncFunction->arg_begin();
+    for (int i = 0; i < type->GetNumParameters(); ++i)
+        ++handleArg;
+
+    FunctionEmitContext ec(this, sym, asyncFunction, firstStmtPos);
+    ec.SetAsyncLaunchHandlePtr(&*handleArg);
+    emitCode(&ec, asyncFunction, firstStmtPos);
+
+    if (m->errorCount == 0) {
+        Symbol *asyncSym = new Symbol(asyncName, sym->pos, asyncType,
+                                      sym->storageClass);
+        asyncSym->function = asyncFunction;
+        asyncSym->exportedFunction = asyncFunction;
+        m->symbolTable->AddFunction(asyncSym);
+    }
+}
+
+
+bool
+Function::IsStdlibFunction() const {
+    return isStdlib;
+}
+
+
+bool
+Function::IsReferenced() const {
+    if (sym == NULL || sym->function == NULL)
+        return false;
+    return sym->function->use_empty() == false ||
+        sym->function->empty() == false;
+}
+
+
+void
+Function::RemoveDeclaration() {
+    if (sym == NULL || sym->function == NULL || IsReferenced())
+        return;
+    sym->function->eraseFromParent();
+    sym->function = NULL;
+}
+
+
 void
 Function::GenerateIR() {
     if (sym == NULL)
@@ -516,15 +980,7 @@ Function::GenerateIR() {
             if (!type->isTask) {
                 llvm::FunctionType *ftype = type->LLVMFunctionType(g->ctx, true);
                 llvm::GlobalValue::LinkageTypes linkage = llvm::GlobalValue::ExternalLinkage;
-                std::string functionName = sym->name;
-                if (g->mangleFunctionsWithTarget) {
-                    // If we treat generic as smth, we should have appropriate mangling
-                    if (g->target->getISA() == Target::GENERIC &&
-                        !g->target->getTreatGenericAsSmth().empty())
-                        functionName += std::string("_") + g->target->getTreatGenericAsSmth();
-                    else
-                        functionName += std::string("_") + g->target->GetISAString();
-                }
+                std::string functionName = lExportedFunctionName(sym->name);
 #ifdef ISPC_NVPTX_ENABLED
                 if (g->target->getISA() == Target::NVPTX)
                 {
@@ -565,6 +1021,12 @@ Function::GenerateIR() {
                     emitCode(&ec, appFunction, firstStmtPos);
                     if (m->errorCount == 0) {
                         sym->exportedFunction = appFunction;
+                        if (type->specializations.size() > 0
+#ifdef ISPC_NVPTX_ENABLED
+                            && g->target->getISA() != Target::NVPTX
+#endif /* ISPC_NVPTX_ENABLED */
+                            )
+                            lSpecializeExportedFunction(appFunction, type, sym->pos);
                     }
 #ifdef ISPC_NVPTX_ENABLED
                     if (g->target->getISA() == Target::NVPTX)
@@ -579,6 +1041,30 @@ Function::GenerateIR() {
                     }
 #endif /* ISPC_NVPTX_ENABLED */
                 }
+
+                if (m->errorCount == 0 && type->isAsync
+#ifdef ISPC_NVPTX_ENABLED
+                    && g->target->getISA() != Target::NVPTX
+#endif /* ISPC_NVPTX_ENABLED */
+                    ) {
+                    // The asynchronous variant is emitted from the same
+                    // AST, which would give it its own copies of any
+                    // static locals.
+                    const Symbol *staticSym = lFindStaticLocal(code);
+                    if (staticSym != NULL)
+                        Error(staticSym->pos, "\"static\" variable \"%s\" "
+                              "can't be declared in \"async\" function "
+                              "\"%s\".", staticSym->name.c_str(),
+                              sym->name.c_str());
+                    else {
+                        if (!lContainsLaunch(code))
+                            Warning(sym->pos, "\"async\" function \"%s\" "
+                                    "doesn't launch any tasks; its "
+                                    "asynchronous variant always returns a "
+                                    "NULL handle.", sym->name.c_str());
+                        generateAsyncExportedIR(firstStmtPos);
+                    }
+                }
             }
         }
     }
@@ -51,13 +51,26 @@ public:
     /** Generate LLVM IR for the function into the current module. */
     void GenerateIR();
 
+    /** Returns true if the function is defined in the standard library. */
+    bool IsStdlibFunction() const;
+
+    /** Returns true if the function is called or otherwise referenced by
+        the IR generated so far, or if it already has a definition. */
+    bool IsReferenced() const;
+
+    /** Removes the declaration of an unreferenced function without a
+        definition from the current module. */
+    void RemoveDeclaration();
+
 private:
     void emitCode(FunctionEmitContext *ctx, llvm::Function *function,
                   SourcePos firstStmtPos);
+    void generateAsyncExportedIR(SourcePos firstStmtPos);
 
     Symbol *sym;
     std::vector<Symbol *> args;
     Stmt *code;
+    bool isStdlib;
     Symbol *maskSymbol;
     Symbol *threadIndexSym, *threadCountSym;
     Symbol *taskIndexSym,   *taskCountSym;
@@ -418,6 +418,31 @@ public:
 };
 
 
+/** Returns the LLVM target features that code generated for the given ISA
+    depends on, or an empty string if there aren't any beyond the
+    architecture's baseline.  These match the features of the CPU that is
+    used for the ISA by default (e.g. "corei7" for SSE4), so code
+    generated with --lto uses the same instructions as it would
+    otherwise. */
+static std::string
+lGetISAFeatures(Target::ISA isa) {
+    switch (isa) {
+    case Target::SSE2:
+        return "+sse2";
+    case Target::SSE4:
+        return "+sse4.2,+popcnt";
+    case Target::AVX:
+        return "+avx,+popcnt";
+    case Target::AVX11:
+        return "+avx,+popcnt,+f16c,+rdrnd";
+    case Target::AVX2:
+        return "+avx2,+fma,+popcnt,+f16c,+rdrnd";
+    default:
+        return "";
+    }
+}
+
+
 Target::Target(const char *arch, const char *cpu, const char *isa, bool pic, std::string genericAsSmth) :
     m_target(NULL),
     m_targetMachine(NULL),
@@ -1029,13 +1054,28 @@ Target::Target(const char *arch, const char *cpu, const char *isa, bool pic, std
 #if !defined(LLVM_3_2)
         // This is LLVM 3.3+ feature.
         // Initialize target-specific "target-feature" attribute.
-        if (!m_attributes.empty()) {
+        std::string features = m_attributes;
+        bool addCPU = true;
+        if (g->linkTimeOptimization) {
+            // When the bitcode is linked with code from other compilers,
+            // the code generator uses the CPU given at link time, so the
+            // functions need to say which features they use.  Giving just
+            // the features that the ISA requires (rather than the CPU's)
+            // also lets them be inlined into callers that were compiled
+            // with those features.
+            if (features.empty())
+                features = lGetISAFeatures(m_isa);
+            addCPU = false;
+        }
+        if (!features.empty()) {
             llvm::AttrBuilder attrBuilder;
 #ifdef ISPC_NVPTX_ENABLED
-            if (m_isa != Target::NVPTX)
+            if (m_isa == Target::NVPTX)
+                addCPU = false;
 #endif
-            attrBuilder.addAttribute("target-cpu", this->m_cpu);
-            attrBuilder.addAttribute("target-features", this->m_attributes);
+            if (addCPU)
+                attrBuilder.addAttribute("target-cpu", this->m_cpu);
+            attrBuilder.addAttribute("target-features", features);
             this->m_tf_attributes = new llvm::AttributeSet(
                 llvm::AttributeSet::get(
                     *g->ctx,
@@ -1368,6 +1408,10 @@ Opt::Opt() {
     disableGatherScatterFlattening = false;
     disableUniformMemoryOptimizations = false;
     disableCoalescing = false;
+    disableUniformPromotion = false;
+    dedupGathers = false;
+    autoSOA = false;
+    reducedPipeline = false;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1380,6 +1424,8 @@ Globals::Globals() {
     runCPP = true;
     debugPrint = false;
     debugIR = -1;
+    timePasses = false;
+    numJobs = 1;
     disableWarnings = false;
     warningsAsErrors = false;
     quiet = false;
@@ -1389,6 +1435,7 @@ Globals::Globals() {
     emitInstrumentation = false;
     emitProfile = false;
     generateDebuggingSymbols = false;
+    linkTimeOptimization = false;
     enableFuzzTest = false;
     fuzzTestSeed = -1;
     mangleFunctionsWithTarget = false;
@@ -524,6 +524,29 @@ struct Opt {
     /** Disables optimizations that coalesce incoherent scalar memory
         access from gathers into wider vector operations, when possible. */
     bool disableCoalescing;
+
+    /** Disables the optimization that finds varying values that are the
+        same across all of the program instances and rewrites the
+        computation of them to use scalar operations.  This is likely only
+        useful for measuring the impact of this optimization. */
+    bool disableUniformPromotion;
+
+    /** Indicates that gathers are expected to often have all of the
+        active program instances reading from the same location; if set,
+        gathers that aren't otherwise optimized check for this case at
+        runtime and do a single scalar load and broadcast when it holds. */
+    bool dedupGathers;
+
+    /** Indicates that a reduced set of optimization passes should be
+        run, skipping the more expensive late loop and scalar
+        optimizations and gather/scatter coalescing; this trades some
+        performance of the generated code for compile time. */
+    bool reducedPipeline;
+
+    /** Indicates that local arrays of uniform structs whose members are
+        only accessed individually should be laid out in SOA format,
+        matching the target's gang size. */
+    bool autoSOA;
 };
 
 /** @brief This structure collects together a number of global variables.
@@ -569,6 +592,14 @@ struct Globals {
     /** Indicates which phases of optimization we want to switch off. */
     std::set<int> off_stages;
 
+    /** When \c true, a report of the time spent in each LLVM pass is
+        printed after optimization and after code generation. */
+    bool timePasses;
+
+    /** Maximum number of targets of a multi-target compilation for which
+        code is generated concurrently, each in its own child process. */
+    int numJobs;
+
     /** Indicates whether all warning messages should be surpressed. */
     bool disableWarnings;
 
@@ -604,6 +635,13 @@ struct Globals {
         program in its output. */
     bool generateDebuggingSymbols;
 
+    /** Indicates that the bitcode output is going to be linked and
+        optimized along with bitcode from other compilers (e.g. by "clang
+        -flto"), so functions should be annotated with the target features
+        they need rather than relying on the CPU given when it is compiled
+        to native code. */
+    bool linkTimeOptimization;
+
     /** If true, function names are mangled by appending the target ISA and
         vector width to them. */
     bool mangleFunctionsWithTarget;
@@ -637,6 +675,16 @@ struct Globals {
 
     /** When true, flag non-static functions with dllexport attribute on Windows. */
     bool dllExport;
+
+    /** If non-empty, the name of the file to write a JSON report of the
+        time and memory used by each phase of compilation to; see the
+        StatsTimer class. */
+    std::string statsFileName;
+
+    /** All of the command-line arguments (including ones from ISPC_ARGS),
+        separated by NUL characters; this is part of the key for entries
+        in the compilation cache. */
+    std::string commandLine;
 };
 
 enum {
@@ -668,6 +716,7 @@ enum {
     COST_ASSERT = 8,
 
     CHECK_MASK_AT_FUNCTION_START_COST = 16,
+    VERSION_VARYING_LOOP_MAX_COST = 64,
     PREDICATE_SAFE_IF_STATEMENT_COST = 6,
 };
 
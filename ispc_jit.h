@@ -0,0 +1,89 @@
+/*
+  Copyright (c) 2015, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file ispc_jit.h
+    @brief C interface for compiling ispc programs in-process and calling
+    them through function pointers.
+
+    This header is intended to be included by applications that link with
+    libispc; it doesn't depend on any of the compiler's internal headers.
+    None of these functions are thread-safe: the compiler keeps its state
+    in globals, so calls must be serialized by the caller.
+ */
+
+#ifndef ISPC_JIT_H
+#define ISPC_JIT_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Opaque handle to a JIT compiler for a particular target. */
+typedef struct ispc_jit ispc_jit;
+
+/** Opaque handle to a compiled program; functions returned by
+    ispc_jit_get_function() stay valid until it is freed. */
+typedef struct ispc_jit_module ispc_jit_module;
+
+/** Creates a JIT compiler.  If target is NULL, the best ISA that the host
+    CPU supports is used (as with running ispc without a --target
+    option); otherwise it gives a single target, like "avx2-i32x8", which
+    must be one that the host can run.  If cpu is NULL, the host CPU type
+    is used.  optLevel is 0 or 1, as with ispc's -O0 and -O1 options.
+    Returns NULL if the target can't be used. */
+ispc_jit *ispc_jit_create(const char *target, const char *cpu, int optLevel);
+
+/** Releases the JIT compiler; modules compiled with it must have been
+    freed first. */
+void ispc_jit_destroy(ispc_jit *jit);
+
+/** Compiles the ispc program given by source.  The name is used for the
+    source file in diagnostics, which are printed to stderr as they are by
+    the command-line compiler.  Returns NULL if there were any errors. */
+ispc_jit_module *ispc_jit_compile(ispc_jit *jit, const char *source,
+                                  const char *name);
+
+/** Returns a pointer to the 'export'ed function with the given name in
+    the compiled program, or NULL if there is no such function.  The
+    function's signature is the same one that ispc would emit for it in a
+    header file. */
+void *ispc_jit_get_function(ispc_jit_module *module, const char *name);
+
+/** Releases the code and data of a compiled program. */
+void ispc_jit_free_module(ispc_jit_module *module);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ISPC_JIT_H
@@ -0,0 +1,227 @@
+/*
+  Copyright (c) 2015, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file jit.cpp
+    @brief Implementation of the C interface in ispc_jit.h for compiling
+    ispc programs in-process with LLVM's MCJIT.
+*/
+
+#include "ispc_jit.h"
+#include "ispc.h"
+#include "module.h"
+#include "util.h"
+#include <string.h>
+#if defined(LLVM_3_2)
+  #include <llvm/Module.h>
+#else
+  #include <llvm/IR/Module.h>
+#endif
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetOptions.h>
+
+struct ispc_jit {
+    /** The target is created once and reused for all of the programs that
+        are compiled with this JIT, so that the TargetMachine and target
+        data layout aren't recomputed for each compilation. */
+    Target *target;
+    int optLevel;
+};
+
+struct ispc_jit_module {
+    /** The execution engine owns the llvm::Module and the memory holding
+        the generated code. */
+    llvm::ExecutionEngine *engine;
+};
+
+
+/** Does the one-time setup that main() does for the ispc executable:
+    creating the globals and registering the LLVM target for the host.
+    In-process compilation can only target the host, so there's no need
+    to register the others. */
+static void
+lInitialize() {
+    static bool initialized = false;
+    if (initialized)
+        return;
+    initialized = true;
+
+    if (g == NULL)
+        g = new Globals;
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    // Make symbols in the host process, like the ISPCLaunch() and
+    // ISPCAlloc() task system functions, visible to the generated code.
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(NULL);
+}
+
+
+ispc_jit *
+ispc_jit_create(const char *target, const char *cpu, int optLevel) {
+    lInitialize();
+
+    if (target != NULL && strchr(target, ',') != NULL) {
+        Error(SourcePos(), "Only a single target can be used for in-process "
+              "compilation.");
+        return NULL;
+    }
+
+    // Choosing the host's ISA is the expected behavior here, so don't
+    // issue the warning about it that the command-line compiler does.
+    bool disableWarnings = g->disableWarnings;
+    g->disableWarnings = true;
+    Target *t = new Target(NULL /* host arch */, cpu, target,
+                           true /* PIC */);
+    g->disableWarnings = disableWarnings;
+    if (!t->isValid()) {
+        delete t;
+        return NULL;
+    }
+    if (t->getISA() == Target::GENERIC
+#ifdef ISPC_NVPTX_ENABLED
+        || t->getISA() == Target::NVPTX
+#endif /* ISPC_NVPTX_ENABLED */
+        ) {
+        Error(SourcePos(), "Target \"%s\" can't be used for in-process "
+              "compilation.", t->GetISAString());
+        delete t;
+        return NULL;
+    }
+
+    ispc_jit *jit = new ispc_jit;
+    jit->target = t;
+    jit->optLevel = (optLevel > 0) ? 1 : 0;
+    return jit;
+}
+
+
+void
+ispc_jit_destroy(ispc_jit *jit) {
+    if (jit == NULL)
+        return;
+    delete jit->target;
+    delete jit;
+}
+
+
+ispc_jit_module *
+ispc_jit_compile(ispc_jit *jit, const char *source, const char *name) {
+    if (jit == NULL || source == NULL)
+        return NULL;
+    if (name == NULL)
+        name = "<jit>";
+
+    g->target = jit->target;
+    g->opt.level = jit->optLevel;
+
+    m = new Module(name, source);
+    int errorCount = m->CompileFile();
+    if (errorCount == 0)
+        errorCount = m->errorCount;
+
+    llvm::Module *module = m->module;
+    delete m;
+    m = NULL;
+    g->target = NULL;
+
+    if (errorCount > 0) {
+        delete module;
+        return NULL;
+    }
+
+    std::string errorString;
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4) || defined(LLVM_3_5)
+    llvm::EngineBuilder builder(module);
+    builder.setUseMCJIT(true);
+#else // LLVM 3.6+
+    llvm::EngineBuilder builder((std::unique_ptr<llvm::Module>(module)));
+#endif
+    builder.setEngineKind(llvm::EngineKind::JIT);
+    builder.setErrorStr(&errorString);
+    builder.setMCPU(jit->target->getCPU());
+    builder.setOptLevel(jit->optLevel > 0 ? llvm::CodeGenOpt::Aggressive :
+                        llvm::CodeGenOpt::None);
+
+    llvm::TargetOptions options;
+    if (g->opt.disableFMA == false)
+        options.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+    builder.setTargetOptions(options);
+
+    llvm::ExecutionEngine *engine = builder.create();
+    if (engine == NULL) {
+        Error(SourcePos(), "Unable to create execution engine: %s",
+              errorString.c_str());
+        return NULL;
+    }
+
+#if !defined(LLVM_3_2)
+    // Generate the code now so that all of the compilation cost is paid
+    // here rather than at the first ispc_jit_get_function() call.
+    engine->finalizeObject();
+#endif
+
+    ispc_jit_module *jitModule = new ispc_jit_module;
+    jitModule->engine = engine;
+    return jitModule;
+}
+
+
+void *
+ispc_jit_get_function(ispc_jit_module *jitModule, const char *name) {
+    if (jitModule == NULL || name == NULL)
+        return NULL;
+
+#if defined(LLVM_3_2) || defined(LLVM_3_3)
+    llvm::Function *func = jitModule->engine->FindFunctionNamed(name);
+    if (func == NULL || func->isDeclaration())
+        return NULL;
+    return jitModule->engine->getPointerToFunction(func);
+#else // LLVM 3.4+
+    return (void *)jitModule->engine->getFunctionAddress(name);
+#endif
+}
+
+
+void
+ispc_jit_free_module(ispc_jit_module *jitModule) {
+    if (jitModule == NULL)
+        return;
+    // Deleting the engine also deletes the llvm::Module it owns.
+    delete jitModule->engine;
+    delete jitModule;
+}
@@ -1121,9 +1121,37 @@ lVectorValuesAllEqual(llvm::Value *v, int vectorLength,
     }
 
     llvm::CastInst *cast = llvm::dyn_cast<llvm::CastInst>(v);
-    if (cast != NULL)
+    if (cast != NULL) {
+        // A bitcast that changes the number of elements splits or merges
+        // elements, so equal source elements don't imply equal results
+        // (e.g. the two halves of an i64 bitcast to a pair of i32s).
+        llvm::VectorType *srcType =
+            llvm::dyn_cast<llvm::VectorType>(cast->getOperand(0)->getType());
+        if (srcType == NULL || (int)srcType->getNumElements() != vectorLength)
+            return false;
         return lVectorValuesAllEqual(cast->getOperand(0), vectorLength,
                                      seenPhis);
+    }
+
+    llvm::CmpInst *cmp = llvm::dyn_cast<llvm::CmpInst>(v);
+    if (cmp != NULL)
+        return (lVectorValuesAllEqual(cmp->getOperand(0), vectorLength,
+                                      seenPhis) &&
+                lVectorValuesAllEqual(cmp->getOperand(1), vectorLength,
+                                      seenPhis));
+
+    llvm::SelectInst *select = llvm::dyn_cast<llvm::SelectInst>(v);
+    if (select != NULL) {
+        // The condition may be either a single i1 or a vector of them.
+        llvm::Value *cond = select->getCondition();
+        if (llvm::isa<llvm::VectorType>(cond->getType()) &&
+            !lVectorValuesAllEqual(cond, vectorLength, seenPhis))
+            return false;
+        return (lVectorValuesAllEqual(select->getTrueValue(), vectorLength,
+                                      seenPhis) &&
+                lVectorValuesAllEqual(select->getFalseValue(), vectorLength,
+                                      seenPhis));
+    }
 
     llvm::InsertElementInst *ie = llvm::dyn_cast<llvm::InsertElementInst>(v);
     if (ie != NULL) {
@@ -1157,6 +1185,11 @@ lVectorValuesAllEqual(llvm::Value *v, int vectorLength,
         // ?
         return false;
 
+    if (llvm::isa<llvm::ConstantExpr>(v))
+        // Vector-typed constant expressions are rare enough that we don't
+        // try to evaluate them.
+        return false;
+
     Assert(!llvm::isa<llvm::Constant>(v));
 
     if (llvm::isa<llvm::CallInst>(v) || llvm::isa<llvm::LoadInst>(v) ||
@@ -1535,9 +1568,12 @@ LLVMDumpValue(llvm::Value *v) {
 }
 
 
+static llvm::Value *lExtractFirstVectorElement(llvm::Value *v,
+                                               std::map<llvm::Value *, llvm::Value *> &scalarMap);
+
 static llvm::Value *
-lExtractFirstVectorElement(llvm::Value *v,
-                           std::map<llvm::PHINode *, llvm::PHINode *> &phiMap) {
+lComputeFirstVectorElement(llvm::Value *v,
+                           std::map<llvm::Value *, llvm::Value *> &scalarMap) {
     llvm::VectorType *vt =
         llvm::dyn_cast<llvm::VectorType>(v->getType());
     Assert(vt != NULL);
@@ -1566,9 +1602,9 @@ lExtractFirstVectorElement(llvm::Value *v,
     llvm::BinaryOperator *bop = llvm::dyn_cast<llvm::BinaryOperator>(v);
     if (bop != NULL) {
         llvm::Value *v0 = lExtractFirstVectorElement(bop->getOperand(0),
-                                                     phiMap);
+                                                     scalarMap);
         llvm::Value *v1 = lExtractFirstVectorElement(bop->getOperand(1),
-                                                     phiMap);
+                                                     scalarMap);
         Assert(v0 != NULL);
         Assert(v1 != NULL);
         // Note that the new binary operator is inserted immediately before
@@ -1579,25 +1615,52 @@ lExtractFirstVectorElement(llvm::Value *v,
 
     llvm::CastInst *cast = llvm::dyn_cast<llvm::CastInst>(v);
     if (cast != NULL) {
-        llvm::Value *v = lExtractFirstVectorElement(cast->getOperand(0),
-                                                    phiMap);
-        // Similarly, the equivalent scalar cast instruction goes right
-        // before the vector cast
-        return llvm::CastInst::Create(cast->getOpcode(), v,
-                                      vt->getElementType(), newName,
-                                      cast);
+        llvm::VectorType *srcType =
+            llvm::dyn_cast<llvm::VectorType>(cast->getOperand(0)->getType());
+        // Casts that change the number of elements don't map to a scalar
+        // cast of the first element; they're handled by the generic
+        // extractelement path at the end of this function.
+        if (srcType != NULL &&
+            srcType->getNumElements() == vt->getNumElements()) {
+            llvm::Value *v = lExtractFirstVectorElement(cast->getOperand(0),
+                                                        scalarMap);
+            // Similarly, the equivalent scalar cast instruction goes right
+            // before the vector cast
+            return llvm::CastInst::Create(cast->getOpcode(), v,
+                                          vt->getElementType(), newName,
+                                          cast);
+        }
+    }
+
+    llvm::CmpInst *cmp = llvm::dyn_cast<llvm::CmpInst>(v);
+    if (cmp != NULL) {
+        llvm::Value *v0 = lExtractFirstVectorElement(cmp->getOperand(0),
+                                                     scalarMap);
+        llvm::Value *v1 = lExtractFirstVectorElement(cmp->getOperand(1),
+                                                     scalarMap);
+        return llvm::CmpInst::Create(cmp->getOpcode(), cmp->getPredicate(),
+                                     v0, v1, newName, cmp);
+    }
+
+    llvm::SelectInst *select = llvm::dyn_cast<llvm::SelectInst>(v);
+    if (select != NULL) {
+        llvm::Value *cond = select->getCondition();
+        if (llvm::isa<llvm::VectorType>(cond->getType()))
+            cond = lExtractFirstVectorElement(cond, scalarMap);
+        llvm::Value *v0 = lExtractFirstVectorElement(select->getTrueValue(),
+                                                     scalarMap);
+        llvm::Value *v1 = lExtractFirstVectorElement(select->getFalseValue(),
+                                                     scalarMap);
+        return llvm::SelectInst::Create(cond, v0, v1, newName, select);
     }
 
     llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(v);
     if (phi != NULL) {
-        // For PHI notes, recursively scalarize them.
-        if (phiMap.find(phi) != phiMap.end())
-            return phiMap[phi];
-
-        // We need to create the new scalar PHI node immediately, though,
-        // and put it in the map<>, so that if we come back to this node
-        // via a recursive lExtractFirstVectorElement() call, then we can
-        // return the pointer and not get stuck in an infinite loop.
+        // For PHI notes, recursively scalarize them.  We need to create
+        // the new scalar PHI node immediately, though, and put it in the
+        // map<>, so that if we come back to this node via a recursive
+        // lExtractFirstVectorElement() call, then we can return the
+        // pointer and not get stuck in an infinite loop.
         //
         // The insertion point for the new phi node also has to be the
         // start of the bblock of the original phi node.
@@ -1606,11 +1669,11 @@ lExtractFirstVectorElement(llvm::Value *v,
             llvm::PHINode::Create(vt->getElementType(),
                                   phi->getNumIncomingValues(),
                                   newName, phiInsertPos);
-        phiMap[phi] = scalarPhi;
+        scalarMap[phi] = scalarPhi;
 
         for (unsigned i = 0; i < phi->getNumIncomingValues(); ++i) {
             llvm::Value *v = lExtractFirstVectorElement(phi->getIncomingValue(i),
-                                                        phiMap);
+                                                        scalarMap);
             scalarPhi->addIncoming(v, phi->getIncomingBlock(i));
         }
 
@@ -1626,7 +1689,7 @@ lExtractFirstVectorElement(llvm::Value *v,
         llvm::ShuffleVectorInst *shuf = llvm::dyn_cast<llvm::ShuffleVectorInst>(v);
         llvm::Value *indices = shuf->getOperand(2);
         if (llvm::isa<llvm::ConstantAggregateZero>(indices)) {
-            return lExtractFirstVectorElement(shuf->getOperand(0), phiMap);
+            return lExtractFirstVectorElement(shuf->getOperand(0), scalarMap);
         }
     }
 
@@ -1649,11 +1712,32 @@ lExtractFirstVectorElement(llvm::Value *v,
 }
 
 
+/** Returns the scalar value of the first element of v, reusing the one in
+    scalarMap if it has already been computed. */
+static llvm::Value *
+lExtractFirstVectorElement(llvm::Value *v,
+                           std::map<llvm::Value *, llvm::Value *> &scalarMap) {
+    std::map<llvm::Value *, llvm::Value *>::iterator iter = scalarMap.find(v);
+    if (iter != scalarMap.end())
+        return iter->second;
+
+    llvm::Value *ret = lComputeFirstVectorElement(v, scalarMap);
+    scalarMap[v] = ret;
+    return ret;
+}
+
+
 llvm::Value *
 LLVMExtractFirstVectorElement(llvm::Value *v) {
-    std::map<llvm::PHINode *, llvm::PHINode *> phiMap;
-    llvm::Value *ret = lExtractFirstVectorElement(v, phiMap);
-    return ret;
+    std::map<llvm::Value *, llvm::Value *> scalarMap;
+    return lExtractFirstVectorElement(v, scalarMap);
+}
+
+
+llvm::Value *
+LLVMExtractFirstVectorElement(llvm::Value *v,
+                              std::map<llvm::Value *, llvm::Value *> &scalarMap) {
+    return lExtractFirstVectorElement(v, scalarMap);
 }
 
 
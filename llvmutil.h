@@ -49,6 +49,7 @@
   #include <llvm/IR/DerivedTypes.h>
   #include <llvm/IR/Constants.h>
 #endif
+#include <map>
 
 #define PTYPE(p) (llvm::cast<llvm::SequentialType>((p)->getType()->getScalarType())->getElementType())
 
@@ -295,6 +296,16 @@ extern void LLVMDumpValue(llvm::Value *v);
   */
 extern llvm::Value *LLVMExtractFirstVectorElement(llvm::Value *v);
 
+/** Like LLVMExtractFirstVectorElement(), but the scalar values computed
+    for v and the values it depends on are recorded in scalarMap, and
+    values already in scalarMap are reused rather than being computed
+    again.  This allows several values that share parts of their
+    computation to be scalarized without duplicating the shared parts.
+    The caller must remove any instructions that it erases from the map.
+  */
+extern llvm::Value *LLVMExtractFirstVectorElement(llvm::Value *v,
+                                                  std::map<llvm::Value *, llvm::Value *> &scalarMap);
+
 /** This function takes two vectors, expected to be the same length, and
     returns a new vector of twice the length that represents concatenating
     the two of them. */
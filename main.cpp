@@ -113,7 +113,10 @@ usage(int ret) {
     printf("    [-h <name>/--header-outfile=<name>]\tOutput filename for header\n");
     printf("    [-I <path>]\t\t\t\tAdd <path> to #include file search path\n");
     printf("    [--instrument]\t\t\tEmit instrumentation to gather performance data\n");
+    printf("    [--jobs=<n>]\t\t\tGenerate code for up to <n> targets in parallel with multiple targets\n");
+    printf("    [--lto]\t\t\t\tEmit LLVM bitcode for link-time optimization with clang -flto\n");
     printf("    [--profile]\t\t\tEmit detailed profiling data to monitor performance\n");
+    printf("    [--stats=<file>]\t\t\tWrite per-phase compile time and memory use as JSON to <file> (may be \"-\")\n");
     printf("    [--math-lib=<option>]\t\tSelect math library\n");
     printf("        default\t\t\t\tUse ispc's built-in math functions\n");
     printf("        fast\t\t\t\tUse high-performance but lower-accuracy math functions\n");
@@ -124,7 +127,10 @@ usage(int ret) {
     printf("    [--nocpp]\t\t\t\tDon't run the C preprocessor\n");
     printf("    [-o <name>/--outfile=<name>]\tOutput filename (may be \"-\" for standard output)\n");
     printf("    [-O0/-O(1/2/3)]\t\t\t\tSet optimization level (off or on). Optimizations are on by default.\n");
+    printf("    [-Os]\t\t\t\tRun a reduced set of optimizations, for faster compilation\n");
     printf("    [--opt=<option>]\t\t\tSet optimization option\n");
+    printf("        auto-soa\t\t\tLay out local arrays of uniform structs in SOA format when possible\n");
+    printf("        dedup-gathers\t\t\tCheck whether gathers read a single location before issuing them\n");
     printf("        disable-assertions\t\tRemove assertion statements from final code.\n");
     printf("        disable-fma\t\t\tDisable 'fused multiply-add' instructions (on targets that support them)\n");
     printf("        disable-loop-unroll\t\tDisable loop unrolling.\n");
@@ -168,6 +174,7 @@ devUsage(int ret) {
     printf("        disable-handle-pseudo-memory-ops\tLeave __pseudo_* calls for gather/scatter/etc. in final IR\n");
     printf("        disable-uniform-control-flow\t\tDisable uniform control flow optimizations\n");
     printf("        disable-uniform-memory-optimizations\tDisable uniform-based coherent memory access\n");
+    printf("        disable-uniform-promotion\t\tDisable scalarizing varying values that are the same in all lanes\n");
     printf("    [--yydebug]\t\t\t\tPrint debugging information during parsing\n");
     printf("    [--debug-phase=<value>]\t\tSet optimization phases to dump. --debug-phase=first,210:220,300,305,310:last\n");
 
@@ -175,6 +182,7 @@ devUsage(int ret) {
     printf("    [--debug-ir=<value>]\t\tSet optimization phase to generate debugIR after it\n");
 #endif
     printf("    [--off-phase=<value>]\t\tSwitch off optimization phases. --off-phase=first,210:220,300,305,310:last\n");
+    printf("    [--time-passes]\t\t\tPrint the time spent in each optimization and code generation pass\n");
     exit(ret);
 }
 
@@ -299,6 +307,10 @@ int main(int Argc, char *Argv[]) {
     int argc;
     char *argv[128];
     lGetAllArgs(Argc, Argv, argc, argv);
+    for (int i = 1; i < argc; ++i) {
+        g->commandLine += argv[i];
+        g->commandLine += '\0';
+    }
 
     llvm::sys::AddSignalHandler(lSignal, NULL);
 
@@ -396,6 +408,10 @@ int main(int Argc, char *Argv[]) {
             ot = Module::CXX;
         else if (!strcmp(argv[i], "--emit-llvm"))
             ot = Module::Bitcode;
+        else if (!strcmp(argv[i], "--lto")) {
+            ot = Module::Bitcode;
+            g->linkTimeOptimization = true;
+        }
         else if (!strcmp(argv[i], "--emit-obj"))
             ot = Module::Object;
         else if (!strcmp(argv[i], "-I")) {
@@ -450,6 +466,10 @@ int main(int Argc, char *Argv[]) {
                 g->opt.disableFMA = true;
             else if (!strcmp(opt, "force-aligned-memory"))
                 g->opt.forceAlignedMemory = true;
+            else if (!strcmp(opt, "dedup-gathers"))
+                g->opt.dedupGathers = true;
+            else if (!strcmp(opt, "auto-soa"))
+                g->opt.autoSOA = true;
 
             // These are only used for performance tests of specific
             // optimizations
@@ -473,6 +493,8 @@ int main(int Argc, char *Argv[]) {
                 g->opt.disableGatherScatterFlattening = true;
             else if (!strcmp(opt, "disable-uniform-memory-optimizations"))
                 g->opt.disableUniformMemoryOptimizations = true;
+            else if (!strcmp(opt, "disable-uniform-promotion"))
+                g->opt.disableUniformPromotion = true;
             else {
                 fprintf(stderr, "Unknown --opt= option \"%s\".\n", opt);
                 usage(1);
@@ -481,6 +503,21 @@ int main(int Argc, char *Argv[]) {
         else if (!strncmp(argv[i], "--force-alignment=", 18)) {
             g->forceAlignment = atoi(argv[i] + 18);
         }
+        else if (!strncmp(argv[i], "--jobs=", 7)) {
+            g->numJobs = atoi(argv[i] + 7);
+            if (g->numJobs < 1) {
+                fprintf(stderr, "Invalid value \"%s\" for --jobs; must be at "
+                        "least 1.\n", argv[i] + 7);
+                usage(1);
+            }
+        }
+        else if (!strncmp(argv[i], "--stats=", 8)) {
+            g->statsFileName = argv[i] + 8;
+            if (g->statsFileName.empty()) {
+                fprintf(stderr, "No file name specified for --stats.\n");
+                usage(1);
+            }
+        }
         else if (!strcmp(argv[i], "--woff") || !strcmp(argv[i], "-woff")) {
             g->disableWarnings = true;
             g->emitPerfWarnings = false;
@@ -515,10 +552,16 @@ int main(int Argc, char *Argv[]) {
         }
         else if (!strcmp(argv[i], "-O0")) {
             g->opt.level = 0;
+            g->opt.reducedPipeline = false;
         }
         else if (!strcmp(argv[i], "-O") ||  !strcmp(argv[i], "-O1") ||
                  !strcmp(argv[i], "-O2") || !strcmp(argv[i], "-O3")) {
             g->opt.level = 1;
+            g->opt.reducedPipeline = false;
+        }
+        else if (!strcmp(argv[i], "-Os")) {
+            g->opt.level = 1;
+            g->opt.reducedPipeline = true;
         }
         else if (!strcmp(argv[i], "-"))
             ;
@@ -574,6 +617,8 @@ int main(int Argc, char *Argv[]) {
         else if (strncmp(argv[i], "--off-phase=", 12) == 0) {
             g->off_stages = ParsingPhases(argv[i] + strlen("--off-phase="));
         }
+        else if (!strcmp(argv[i], "--time-passes"))
+            g->timePasses = true;
         else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
             lPrintVersion();
             return 0;
@@ -611,6 +656,12 @@ int main(int Argc, char *Argv[]) {
 #endif
     }
 
+    if (g->linkTimeOptimization && ot != Module::Bitcode) {
+        fprintf(stderr, "--lto can't be used with --emit-asm, --emit-c++ or "
+                "--emit-obj.\n");
+        usage(1);
+    }
+
     if (outFileName == NULL &&
         headerFileName == NULL &&
         depsFileName == NULL &&
@@ -629,6 +680,8 @@ int main(int Argc, char *Argv[]) {
                                     depsFileName,
                                     hostStubFileName,
                                     devStubFileName);
+    if (!g->statsFileName.empty() && !WriteStats())
+      return 1;
     if (success != 0)
       return 1;
 
@@ -68,6 +68,8 @@
 #include <windows.h>
 #include <io.h>
 #define strcasecmp stricmp
+#else
+#include <sys/wait.h>
 #endif
 
 #if defined(LLVM_3_2)
@@ -104,6 +106,7 @@
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Support/FormattedStream.h>
 #include <llvm/Support/FileUtilities.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 #if defined(LLVM_3_2)
@@ -128,8 +131,15 @@
 #include <clang/Frontend/TextDiagnosticPrinter.h>
 #include <clang/Frontend/Utils.h>
 #include <clang/Basic/TargetInfo.h>
+#include <clang/Lex/Preprocessor.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#if defined(LLVM_3_2) || defined(LLVM_3_3)
+  #include <llvm/Support/Path.h>
+#else
+  #include <llvm/Support/FileSystem.h>
+#endif
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Bitcode/ReaderWriter.h>
 
@@ -416,15 +426,20 @@ lStripUnusedDebugInfo(llvm::Module *module) {
 ///////////////////////////////////////////////////////////////////////////
 // Module
 
-Module::Module(const char *fn) {
+Module::Module(const char *fn, const char *src) {
     // It's a hack to do this here, but it must be done after the target
     // information has been set (so e.g. the vector width is known...)  In
     // particular, if we're compiling to multiple targets with different
     // vector widths, this needs to be redone each time through.
     InitLLVMUtil(g->ctx, *g->target);
 
+    firstASTNode = GetASTNodeMark();
+    firstSymbol = GetSymbolMark();
+
     filename = fn;
+    source = src;
     errorCount = 0;
+    parsingStdlib = false;
     symbolTable = new SymbolTable;
     ast = new AST;
 
@@ -479,6 +494,51 @@ Module::Module(const char *fn) {
 }
 
 
+Module::~Module() {
+    delete diBuilder;
+    delete ast;
+    delete symbolTable;
+    FreeASTNodes(firstASTNode);
+    FreeSymbols(firstSymbol);
+}
+
+
+static bool
+lSymbolIsExported(const Symbol *s) {
+    return s->exportedFunction != NULL;
+}
+
+
+/** Exported functions with at most this many instructions after
+    optimization are given an "inlinehint" attribute for link-time
+    optimization. */
+static const int lSmallExportedFunctionSize = 64;
+
+/** When generating bitcode for link-time optimization, mark the
+    application-callable versions of small exported functions as good
+    candidates for inlining into their callers in the application. */
+static void
+lMarkSmallExportedFunctions(SymbolTable *symbolTable) {
+    std::vector<Symbol *> syms;
+    symbolTable->GetMatchingFunctions(lSymbolIsExported, &syms);
+    for (unsigned int i = 0; i < syms.size(); ++i) {
+        llvm::Function *func = syms[i]->exportedFunction;
+        if (func->isDeclaration())
+            continue;
+
+        int size = 0;
+        for (llvm::Function::iterator bb = func->begin(); bb != func->end(); ++bb)
+            size += (int)bb->size();
+        if (size <= lSmallExportedFunctionSize)
+#ifdef LLVM_3_2
+            func->addFnAttr(llvm::Attributes::InlineHint);
+#else // LLVM 3.3+
+            func->addFnAttr(llvm::Attribute::InlineHint);
+#endif
+    }
+}
+
+
 extern FILE *yyin;
 extern int yyparse();
 typedef struct yy_buffer_state *YY_BUFFER_STATE;
@@ -501,7 +561,7 @@ Module::CompileFile() {
     bool runPreprocessor = g->runCPP;
 
     if (runPreprocessor) {
-        if (filename != NULL) {
+        if (filename != NULL && source == NULL) {
             // Try to open the file first, since otherwise we crash in the
             // preprocessor if the file doesn't exist.
             FILE *f = fopen(filename, "r");
@@ -512,10 +572,22 @@ Module::CompileFile() {
             fclose(f);
         }
 
+        const char *infilename = (filename != NULL) ? filename : "-";
         std::string buffer;
-        llvm::raw_string_ostream os(buffer);
-        execPreprocessor((filename != NULL) ? filename : "-", &os);
-        YY_BUFFER_STATE strbuf = yy_scan_string(os.str().c_str());
+        if (!getSharedPreprocessorOutput(infilename, &buffer)) {
+            StatsTimer timer("Preprocess");
+            llvm::raw_string_ostream os(buffer);
+            execPreprocessor(infilename, &os);
+            os.flush();
+        }
+        YY_BUFFER_STATE strbuf = yy_scan_string(buffer.c_str());
+        StatsTimer timer("Parse");
+        yyparse();
+        yy_delete_buffer(strbuf);
+    }
+    else if (source != NULL) {
+        YY_BUFFER_STATE strbuf = yy_scan_string(source);
+        StatsTimer timer("Parse");
         yyparse();
         yy_delete_buffer(strbuf);
     }
@@ -533,6 +605,7 @@ Module::CompileFile() {
         }
         yyin = f;
         yy_switch_to_buffer(yy_create_buffer(yyin, 4096));
+        StatsTimer timer("Parse");
         yyparse();
         fclose(f);
     }
@@ -541,8 +614,14 @@ Module::CompileFile() {
 
     if (diBuilder)
         diBuilder->finalize();
-    if (errorCount == 0)
-        Optimize(module, g->opt.level);
+    if (errorCount == 0) {
+        {
+            StatsTimer timer("OptimizeIR");
+            Optimize(module, g->opt.level);
+        }
+        if (g->linkTimeOptimization)
+            lMarkSmallExportedFunctions(symbolTable);
+    }
 
     return errorCount;
 }
@@ -1300,7 +1379,9 @@ Module::writeOutput(OutputType outputType, const char *outFileName,
       return writeHostStub(outFileName);
     else if (outputType == DevStub)
       return writeDevStub(outFileName);
-    else if (outputType == Bitcode)
+
+    StatsTimer timer("CodeGen");
+    if (outputType == Bitcode)
         return writeBitcode(module, outFileName);
     else if (outputType == CXX) {
         if (g->target->getISA() != Target::GENERIC) {
@@ -1543,6 +1624,9 @@ Module::writeObjectFileOrAssembly(llvm::TargetMachine *targetMachine,
     // Finally, run the passes to emit the object file/assembly
     pm.run(*module);
 
+    if (g->timePasses)
+        llvm::TimerGroup::printAll(llvm::errs());
+
     // Success; tell tool_output_file to keep the final output file.
     of->keep();
 
@@ -2460,17 +2544,105 @@ Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
     return true;
 }
 
-void
-Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostream) const
+#ifndef ISPC_IS_WINDOWS
+pid_t
+Module::writeOutputInChild(OutputType outputType, const char *outFileName,
+                           const char *includeFileName) {
+    // Don't have both processes write out anything already buffered.
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        bool ok = writeOutput(outputType, outFileName, includeFileName);
+        fflush(stdout);
+        fflush(stderr);
+        _exit((ok && errorCount == 0) ? 0 : 1);
+    }
+    return pid;
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+/** State of the preprocessed source shared between the targets of a
+    multi-target compilation. */
+enum SharedPreprocessorState {
+    SHARED_PP_DISABLED,   /** Each target runs the preprocessor */
+    SHARED_PP_UNKNOWN,    /** Not yet known if the output can be shared */
+    SHARED_PP_AVAILABLE   /** lSharedPreprocessorOutput holds the output */
+};
+
+static SharedPreprocessorState lSharedPreprocessorState = SHARED_PP_DISABLED;
+static std::string lSharedPreprocessorOutput;
+
+
+bool
+Module::getSharedPreprocessorOutput(const char *infilename,
+                                    std::string *output) const {
+    if (lSharedPreprocessorState == SHARED_PP_DISABLED)
+        return false;
+#ifdef ISPC_NVPTX_ENABLED
+    // NVPTX defines many more macros of its own.
+    if (g->target->getISA() == Target::NVPTX)
+        return false;
+#endif /* ISPC_NVPTX_ENABLED */
+
+    // Standard input can only be read once.
+    if (!strcmp(infilename, "-")) {
+        lSharedPreprocessorState = SHARED_PP_DISABLED;
+        return false;
+    }
+
+    if (lSharedPreprocessorState == SHARED_PP_UNKNOWN) {
+        // Preprocess the file without any of the target-specific macros
+        // defined; if the source didn't refer to any of them, the output
+        // is the same for all of the targets.  Diagnostics are held back
+        // until we know that the output is used, since those from a
+        // source that depends on the target (e.g. an "#error" if no
+        // target macro is defined) would be bogus.
+        std::string buffer, diagnostics;
+        bool dependsOnTarget;
+        {
+            StatsTimer timer("Preprocess");
+            llvm::raw_string_ostream os(buffer);
+            dependsOnTarget = execPreprocessor(infilename, &os, false,
+                                               true, &diagnostics);
+            os.flush();
+        }
+        if (dependsOnTarget) {
+            lSharedPreprocessorState = SHARED_PP_DISABLED;
+            return false;
+        }
+        fputs(diagnostics.c_str(), stderr);
+        lSharedPreprocessorOutput = buffer;
+        lSharedPreprocessorState = SHARED_PP_AVAILABLE;
+    }
+
+    *output = lSharedPreprocessorOutput;
+    return true;
+}
+
+
+bool
+Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostream,
+                         bool defineTargetMacros, bool printDiagnostics,
+                         std::string *diagnostics) const
 {
     clang::CompilerInstance inst;
     inst.createFileManager();
 
     llvm::raw_fd_ostream stderrRaw(2, false);
+    llvm::raw_null_ostream nullStream;
+    std::string unusedDiagnostics;
+    llvm::raw_string_ostream diagStringStream(diagnostics != NULL ?
+                                              *diagnostics : unusedDiagnostics);
+    llvm::raw_ostream &diagStream = (diagnostics != NULL) ?
+        (llvm::raw_ostream &)diagStringStream :
+        (printDiagnostics ? (llvm::raw_ostream &)stderrRaw : nullStream);
 
     clang::DiagnosticOptions *diagOptions = new clang::DiagnosticOptions();
     clang::TextDiagnosticPrinter *diagPrinter =
-        new clang::TextDiagnosticPrinter(stderrRaw, diagOptions);
+        new clang::TextDiagnosticPrinter(diagStream, diagOptions);
     
     llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> diagIDs(new clang::DiagnosticIDs);
     clang::DiagnosticsEngine *diagEngine =
@@ -2509,8 +2681,22 @@ Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostre
 
     inst.setTarget(target);
     inst.createSourceManager(inst.getFileManager());
-    clang::FrontendInputFile inputFile(infilename, clang::IK_None);
-    inst.InitializeSourceManager(inputFile);
+    if (source != NULL) {
+        // The source manager takes ownership of the buffer.
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4) || defined(LLVM_3_5)
+        llvm::MemoryBuffer *buffer =
+            llvm::MemoryBuffer::getMemBufferCopy(source, infilename);
+#else // LLVM 3.6+
+        llvm::MemoryBuffer *buffer =
+            llvm::MemoryBuffer::getMemBufferCopy(source, infilename).release();
+#endif
+        clang::FrontendInputFile inputFile(buffer, clang::IK_None);
+        inst.InitializeSourceManager(inputFile);
+    }
+    else {
+        clang::FrontendInputFile inputFile(infilename, clang::IK_None);
+        inst.InitializeSourceManager(inputFile);
+    }
 
     // Don't remove comments in the preprocessor, so that we can accurately
     // track the source file position by handling them ourselves.
@@ -2542,27 +2728,31 @@ Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostre
     opts.addMacroDef("PI=3.1415926535");
 
     // Add #define for current compilation target
-    char targetMacro[128];
-    sprintf(targetMacro, "ISPC_TARGET_%s", g->target->GetISAString());
-    char *p = targetMacro;
-    while (*p) {
-        *p = toupper(*p);
-        if (*p == '-') *p = '_';
-        ++p;
+    if (defineTargetMacros) {
+        char targetMacro[128];
+        sprintf(targetMacro, "ISPC_TARGET_%s", g->target->GetISAString());
+        char *p = targetMacro;
+        while (*p) {
+            *p = toupper(*p);
+            if (*p == '-') *p = '_';
+            ++p;
+        }
+        opts.addMacroDef(targetMacro);
+
+        if (g->target->hasHalf())
+            opts.addMacroDef("ISPC_TARGET_HAS_HALF");
+        if (g->target->hasRand())
+            opts.addMacroDef("ISPC_TARGET_HAS_RAND");
+        if (g->target->hasTranscendentals())
+            opts.addMacroDef("ISPC_TARGET_HAS_TRANSCENDENTALS");
     }
-    opts.addMacroDef(targetMacro);
 
+    // The pointer size only depends on the architecture, which is the
+    // same for all of the targets of a multi-target compilation.
     if (g->target->is32Bit())
         opts.addMacroDef("ISPC_POINTER_SIZE=32");
     else
         opts.addMacroDef("ISPC_POINTER_SIZE=64");
-
-    if (g->target->hasHalf())
-        opts.addMacroDef("ISPC_TARGET_HAS_HALF");
-    if (g->target->hasRand())
-        opts.addMacroDef("ISPC_TARGET_HAS_RAND");
-    if (g->target->hasTranscendentals())
-        opts.addMacroDef("ISPC_TARGET_HAS_TRANSCENDENTALS");
     if (g->opt.forceAlignedMemory)
         opts.addMacroDef("ISPC_FORCE_ALIGNED_MEMORY");
 
@@ -2617,6 +2807,18 @@ Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostre
     clang::DoPrintPreprocessedInput(inst.getPreprocessor(),
                                     ostream, inst.getPreprocessorOutputOpts());
     diagPrinter->EndSourceFile();
+    diagStringStream.flush();
+
+    // Identifiers are only entered into the table when they're seen
+    // outside of skipped conditional blocks, so any reference to a target
+    // macro (including "#ifdef" tests of ones that aren't defined) shows
+    // up here.
+    clang::IdentifierTable &identifiers = inst.getPreprocessor().getIdentifierTable();
+    for (clang::IdentifierTable::iterator iter = identifiers.begin();
+         iter != identifiers.end(); ++iter)
+        if (iter->getKey().startswith("ISPC_TARGET_"))
+            return true;
+    return false;
 }
 
 
@@ -2678,12 +2880,29 @@ lExtractTargets(const char *target) {
 }
 
 
-static bool
-lSymbolIsExported(const Symbol *s) {
-    return s->exportedFunction != NULL;
+#ifndef ISPC_IS_WINDOWS
+// Waits for the oldest of the given child processes started by
+// Module::writeOutputInChild() until no more than maxRunning of them are still
+// running.  Returns the number of the processes waited for that failed.
+static int
+lWaitForOutputProcesses(std::vector<pid_t> &children, unsigned int maxRunning) {
+    int failures = 0;
+    while (children.size() > maxRunning) {
+        pid_t pid = children.front();
+        children.erase(children.begin());
+
+        int status;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            ++failures;
+    }
+    return failures;
 }
 
 
+#endif // !ISPC_IS_WINDOWS
+
+
 // Small structure to hold pointers to the various different versions of a
 // llvm::Function that were compiled for different compilation target ISAs.
 struct FunctionTargetVariants {
@@ -2913,12 +3132,52 @@ lCreateDispatchFunction(llvm::Module *module, llvm::Function *setISAFunc,
 
     bool voidReturn = ftype->getReturnType()->isVoidTy();
 
-    // Now we can emit the definition of the dispatch function..
+    // Rather than checking the system's ISA each time the dispatch
+    // function is called, it calls through a pointer to the variant to
+    // use.  The pointer starts out pointing to a resolver function, which
+    // does those checks once, updates the pointer with the variant it
+    // chooses, and then calls it.
+    llvm::Function *resolveFunc =
+        llvm::Function::Create(ftype, llvm::GlobalValue::InternalLinkage,
+                               (name + "___resolve").c_str(), module);
+    llvm::GlobalVariable *funcPtr =
+        new llvm::GlobalVariable(*module, llvm::PointerType::get(ftype, 0),
+                                 false /* not constant */,
+                                 llvm::GlobalValue::InternalLinkage,
+                                 resolveFunc, name + "___ptr");
+    int ptrAlign = g->target->is32Bit() ? 4 : 8;
+    funcPtr->setAlignment(ptrAlign);
+
+    // Now we can emit the definition of the dispatch function, which just
+    // loads the pointer and calls through it.  The pointer may be updated
+    // concurrently by resolveFunc in another thread, though always to
+    // the same value, so an unordered atomic load and store suffice.
     llvm::Function *dispatchFunc =
         llvm::Function::Create(ftype, llvm::GlobalValue::ExternalLinkage,
                                name.c_str(), module);
+    {
+        llvm::BasicBlock *bblock =
+            llvm::BasicBlock::Create(*g->ctx, "entry", dispatchFunc);
+        llvm::LoadInst *func = new llvm::LoadInst(funcPtr, "func", bblock);
+        func->setAlignment(ptrAlign);
+        func->setAtomic(llvm::Unordered);
+
+        std::vector<llvm::Value *> args;
+        for (llvm::Function::arg_iterator argIter = dispatchFunc->arg_begin();
+             argIter != dispatchFunc->arg_end(); ++argIter)
+            args.push_back(argIter);
+        llvm::CallInst *call =
+            llvm::CallInst::Create(func, args, voidReturn ? "" : "ret_value",
+                                   bblock);
+        call->setTailCall();
+        if (voidReturn)
+            llvm::ReturnInst::Create(*g->ctx, bblock);
+        else
+            llvm::ReturnInst::Create(*g->ctx, call, bblock);
+    }
+
     llvm::BasicBlock *bblock =
-        llvm::BasicBlock::Create(*g->ctx, "entry", dispatchFunc);
+        llvm::BasicBlock::Create(*g->ctx, "entry", resolveFunc);
 
     // Start by calling out to the function that determines the system's
     // ISA and sets __system_best_isa, if it hasn't been set yet.
@@ -2960,18 +3219,29 @@ lCreateDispatchFunction(llvm::Module *module, llvm::Function *setISAFunc,
             llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_SGE,
                                   systemISA, LLVMInt32(dispatchNum), "isa_ok", bblock);
         llvm::BasicBlock *callBBlock =
-            llvm::BasicBlock::Create(*g->ctx, "do_call", dispatchFunc);
+            llvm::BasicBlock::Create(*g->ctx, "do_call", resolveFunc);
         llvm::BasicBlock *nextBBlock =
-            llvm::BasicBlock::Create(*g->ctx, "next_try", dispatchFunc);
+            llvm::BasicBlock::Create(*g->ctx, "next_try", resolveFunc);
         llvm::BranchInst::Create(callBBlock, nextBBlock, ok, bblock);
 
+        // Remember the choice for subsequent calls.  The target function
+        // may have been declared with a different (but call-compatible)
+        // type than the pointer holds, so cast it to match.
+        llvm::Constant *target =
+            llvm::ConstantExpr::getBitCast(targetFuncs[i],
+                funcPtr->getType()->getPointerElementType());
+        llvm::StoreInst *store =
+            new llvm::StoreInst(target, funcPtr, callBBlock);
+        store->setAlignment(ptrAlign);
+        store->setAtomic(llvm::Unordered);
+
         // Emit the code to make the call call in callBBlock.
         // Just pass through all of the args from the dispatch function to
         // the target-specific function.
         std::vector<llvm::Value *> args;
-        llvm::Function::arg_iterator argIter = dispatchFunc->arg_begin();
+        llvm::Function::arg_iterator argIter = resolveFunc->arg_begin();
         llvm::Function::arg_iterator targsIter = targetFuncs[i]->arg_begin();
-        for (; argIter != dispatchFunc->arg_end(); ++argIter, ++targsIter) {
+        for (; argIter != resolveFunc->arg_end(); ++argIter, ++targsIter) {
           // Check to see if we rewrote any types in the dispatch function.
           // If so, create bitcasts for the appropriate pointer types.
           if (argIter->getType() == targsIter->getType()) {
@@ -3028,6 +3298,12 @@ lCreateDispatchFunction(llvm::Module *module, llvm::Function *setISAFunc,
 static llvm::Module *
 lCreateDispatchModule(std::map<std::string, FunctionTargetVariants> &functions) {
     llvm::Module *module = new llvm::Module("dispatch_module", *g->ctx);
+    if (g->linkTimeOptimization) {
+        // The bitcode will be linked with the application's, which needs
+        // to agree about the target.
+        module->setTargetTriple(g->target->GetTripleString());
+        module->setDataLayout(g->target->getDataLayout()->getStringRepresentation());
+    }
 
     // First, link in the definitions from the builtins-dispatch.ll file.
     extern unsigned char builtins_bitcode_dispatch[];
@@ -3090,6 +3366,180 @@ static std::string lCBEMangle(const std::string &S)
 }
 #endif /* ISPC_NVPTX_ENABLED */
 
+///////////////////////////////////////////////////////////////////////////
+// Compilation cache
+//
+// If the ISPC_CACHE_DIR environment variable is set, the outputs of each
+// compilation are stored in a subdirectory of it, named by a hash of
+// everything that affects them: the ispc build, the command line, and the
+// preprocessed source for each of the targets.  When a later compilation
+// has the same key, the outputs are copied from the cache instead.  (This
+// isn't currently supported on Windows.)
+
+// Updates the given 64-bit FNV-1a hash with the given bytes.
+static uint64_t
+lHashBytes(uint64_t hash, const char *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+// Accumulates a 128-bit hash as two independent 64-bit FNV-1a hashes.
+struct CacheKeyHash {
+    CacheKeyHash() : h0(0xcbf29ce484222325ULL), h1(0x84222325cbf29ce4ULL) { }
+
+    void Add(const std::string &str) {
+        // Include the length so that the boundaries between the hashed
+        // strings matter.
+        uint64_t length = str.size();
+        h0 = lHashBytes(h0, (const char *)&length, sizeof(length));
+        h1 = lHashBytes(h1, (const char *)&length, sizeof(length));
+        h0 = lHashBytes(h0, str.data(), str.size());
+        h1 = lHashBytes(h1, str.data(), str.size());
+    }
+
+    std::string GetString() const {
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)h0,
+                 (unsigned long long)h1);
+        return buf;
+    }
+
+    uint64_t h0, h1;
+};
+
+
+// Returns a string that identifies the running ispc binary, so that the
+// key changes whenever ispc is rebuilt, even if only some of its sources
+// (or the builtins or stdlib) changed: the executable's path, size, inode
+// number and modification time.  Returns an empty string if the
+// executable can't be found.
+static std::string
+lCompilerIdentity() {
+#if defined(LLVM_3_2) || defined(LLVM_3_3)
+    std::string exe =
+        llvm::sys::Path::GetMainExecutable("ispc", (void *)lCompilerIdentity).str();
+#else
+    std::string exe =
+        llvm::sys::fs::getMainExecutable("ispc", (void *)lCompilerIdentity);
+#endif
+    struct stat st;
+    if (exe.empty() || stat(exe.c_str(), &st) != 0)
+        return "";
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), " %lld %lld %lld", (long long)st.st_size,
+             (long long)st.st_ino, (long long)st.st_mtime);
+    return std::string(ISPC_VERSION " ") + exe + buf;
+}
+
+
+// Copies the contents of one file to another, returning false on failure.
+static bool
+lCopyFile(const std::string &from, const std::string &to) {
+    std::ifstream in(from.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+        return false;
+    std::ofstream out(to.c_str(), std::ios::out | std::ios::binary |
+                      std::ios::trunc);
+    if (!out)
+        return false;
+    out << in.rdbuf();
+    return (bool)out;
+}
+
+
+bool
+Module::GetCacheKey(const char *srcFile, const char *arch, const char *cpu,
+                    const char *target, bool generatePIC,
+                    const char *outFileName, const char *headerFileName,
+                    const char *depsFileName, const char *hostStubFileName,
+                    const char *devStubFileName, std::string *key,
+                    std::vector<std::string> *outputFiles) {
+    if (srcFile == NULL || !strcmp(srcFile, "-") ||
+        (outFileName != NULL && !strcmp(outFileName, "-")) ||
+        (headerFileName != NULL && !strcmp(headerFileName, "-")))
+        return false;
+
+    StatsTimer timer("CacheKey");
+    std::string compilerIdentity = lCompilerIdentity();
+    if (compilerIdentity.empty())
+        return false;
+
+    CacheKeyHash hash;
+    hash.Add(compilerIdentity);
+    hash.Add(g->commandLine);
+    if (g->generateDebuggingSymbols)
+        // The debugging information records the directory.
+        hash.Add(g->currentDirectory);
+
+    const char *fileNames[] = { outFileName, headerFileName, depsFileName,
+                                hostStubFileName, devStubFileName };
+    for (unsigned int i = 0; i < sizeof(fileNames) / sizeof(fileNames[0]); ++i)
+        if (fileNames[i] != NULL)
+            outputFiles->push_back(fileNames[i]);
+
+    bool multiTarget = (target != NULL && strchr(target, ',') != NULL);
+    std::vector<std::string> targets;
+    if (multiTarget)
+        targets = lExtractTargets(target);
+    else
+        targets.push_back(target != NULL ? target : "");
+
+    // The preprocessed source differs from one target to the next
+    // (and each one may include different files), so get it for all of
+    // them.
+    for (unsigned int i = 0; i < targets.size(); ++i) {
+        g->target = new Target(arch, cpu, (target != NULL) ? targets[i].c_str() : NULL,
+                               generatePIC);
+        if (!g->target->isValid()) {
+            delete g->target;
+            g->target = NULL;
+            return false;
+        }
+
+        if (multiTarget) {
+            bool forceCXX = (g->target->getISA() == Target::GENERIC &&
+                             !g->target->getTreatGenericAsSmth().empty());
+            std::string isaName = forceCXX ? g->target->getTreatGenericAsSmth() :
+                std::string(g->target->GetISAString());
+            if (outFileName != NULL)
+                outputFiles->push_back(lGetTargetFileName(outFileName,
+                                                          isaName.c_str(), forceCXX));
+            if (headerFileName != NULL)
+                outputFiles->push_back(lGetTargetFileName(headerFileName,
+                                                          isaName.c_str(), false));
+        }
+
+        std::string source;
+        if (g->runCPP) {
+            m = new Module(srcFile);
+            llvm::raw_string_ostream os(source);
+            m->execPreprocessor(srcFile, &os, true, false);
+            os.flush();
+            delete m;
+            m = NULL;
+        }
+        else {
+            std::ifstream in(srcFile, std::ios::in | std::ios::binary);
+            std::stringstream contents;
+            contents << in.rdbuf();
+            source = contents.str();
+        }
+        hash.Add(source);
+
+        delete g->target;
+        g->target = NULL;
+    }
+
+    *key = hash.GetString();
+    return true;
+}
+
+
 int
 Module::CompileAndOutput(const char *srcFile,
                          const char *arch,
@@ -3103,6 +3553,99 @@ Module::CompileAndOutput(const char *srcFile,
                          const char *depsFileName,
                          const char *hostStubFileName,
                          const char *devStubFileName)
+{
+#ifndef ISPC_IS_WINDOWS
+    const char *cacheDir = getenv("ISPC_CACHE_DIR");
+    std::string key;
+    std::vector<std::string> outputFiles;
+    if (cacheDir == NULL || *cacheDir == '\0' ||
+        !GetCacheKey(srcFile, arch, cpu, target, generatePIC, outFileName,
+                     headerFileName, depsFileName, hostStubFileName,
+                     devStubFileName, &key, &outputFiles))
+        return compileAndOutput(srcFile, arch, cpu, target, generatePIC,
+                                outputType, outFileName, headerFileName,
+                                includeFileName, depsFileName,
+                                hostStubFileName, devStubFileName);
+
+    // Each cache entry is a directory holding the output files that the
+    // compilation generated, named by their index in outputFiles.
+    std::string entryDir = std::string(cacheDir) + "/" + key;
+    struct stat st;
+    if (stat(entryDir.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        bool ok = true;
+        for (unsigned int i = 0; i < outputFiles.size() && ok; ++i) {
+            char index[16];
+            snprintf(index, sizeof(index), "/%u", i);
+            std::string cached = entryDir + index;
+            if (stat(cached.c_str(), &st) == 0)
+                ok = lCopyFile(cached, outputFiles[i]);
+        }
+        if (ok) {
+            Debug(SourcePos(), "Using cached outputs from \"%s\".",
+                  entryDir.c_str());
+            return 0;
+        }
+        // Otherwise fall through and compile as usual.
+    }
+
+    int result = compileAndOutput(srcFile, arch, cpu, target, generatePIC,
+                                  outputType, outFileName, headerFileName,
+                                  includeFileName, depsFileName,
+                                  hostStubFileName, devStubFileName);
+    if (result != 0)
+        return result;
+
+    // Populate a temporary directory and then rename it into place, so
+    // that concurrent compilations never see a partial entry.  Failing to
+    // add the entry isn't an error.
+    mkdir(cacheDir, 0777);
+    char tmpSuffix[32];
+    snprintf(tmpSuffix, sizeof(tmpSuffix), ".tmp%d", (int)getpid());
+    std::string tmpDir = entryDir + tmpSuffix;
+    if (mkdir(tmpDir.c_str(), 0777) != 0)
+        return result;
+
+    std::vector<std::string> cachedFiles;
+    bool ok = true;
+    for (unsigned int i = 0; i < outputFiles.size() && ok; ++i) {
+        if (stat(outputFiles[i].c_str(), &st) != 0)
+            // Not all of the possible outputs are necessarily generated.
+            continue;
+        char index[16];
+        snprintf(index, sizeof(index), "/%u", i);
+        cachedFiles.push_back(tmpDir + index);
+        ok = lCopyFile(outputFiles[i], cachedFiles.back());
+    }
+
+    if (!ok || rename(tmpDir.c_str(), entryDir.c_str()) != 0) {
+        for (unsigned int i = 0; i < cachedFiles.size(); ++i)
+            unlink(cachedFiles[i].c_str());
+        rmdir(tmpDir.c_str());
+    }
+
+    return result;
+#else
+    return compileAndOutput(srcFile, arch, cpu, target, generatePIC,
+                            outputType, outFileName, headerFileName,
+                            includeFileName, depsFileName,
+                            hostStubFileName, devStubFileName);
+#endif // !ISPC_IS_WINDOWS
+}
+
+
+int
+Module::compileAndOutput(const char *srcFile,
+                         const char *arch,
+                         const char *cpu,
+                         const char *target,
+                         bool generatePIC,
+                         OutputType outputType,
+                         const char *outFileName,
+                         const char *headerFileName,
+                         const char *includeFileName,
+                         const char *depsFileName,
+                         const char *hostStubFileName,
+                         const char *devStubFileName)
 {
     if (target == NULL || strchr(target, ',') == NULL) {
         // We're only compiling to a single target
@@ -3211,6 +3754,9 @@ Module::CompileAndOutput(const char *srcFile,
         // the target ISA appended to them.
         g->mangleFunctionsWithTarget = true;
 
+        // Try to only run the preprocessor once for all of the targets.
+        lSharedPreprocessorState = SHARED_PP_UNKNOWN;
+
         llvm::TargetMachine *targetMachines[Target::NUM_ISAS];
         for (int i = 0; i < Target::NUM_ISAS; ++i)
             targetMachines[i] = NULL;
@@ -3218,6 +3764,9 @@ Module::CompileAndOutput(const char *srcFile,
         std::map<std::string, FunctionTargetVariants> exportedFunctions;
         std::vector<RewriteGlobalInfo> globals[Target::NUM_ISAS];
         int errorCount = 0;
+#ifndef ISPC_IS_WINDOWS
+        std::vector<pid_t> outputProcesses;
+#endif // !ISPC_IS_WINDOWS
         
         // Handle creating a "generic" header file for multiple targets
         // that use exported varyings
@@ -3272,20 +3821,42 @@ Module::CompileAndOutput(const char *srcFile,
 
                 if (outFileName != NULL) {
                     std::string targetOutFileName;
+                    OutputType targetOutputType = outputType;
+                    const char *targetIncludeFileName = NULL;
                     // We always generate cpp file for *-generic target during multitarget compilation
                     if (g->target->getISA() == Target::GENERIC && 
                         !g->target->getTreatGenericAsSmth().empty()) {
                         targetOutFileName = lGetTargetFileName(outFileName, 
                                                 g->target->getTreatGenericAsSmth().c_str(), true);
-                        if (!m->writeOutput(CXX, targetOutFileName.c_str(), includeFileName))
-                            return 1;
+                        targetOutputType = CXX;
+                        targetIncludeFileName = includeFileName;
                     }
                     else {
                         const char *isaName = g->target->GetISAString();
                         targetOutFileName = lGetTargetFileName(outFileName, isaName, false);
-                        if (!m->writeOutput(outputType, targetOutFileName.c_str()))
-                            return 1;
                     }
+
+                    bool started = false;
+#ifndef ISPC_IS_WINDOWS
+                    if (g->numJobs > 1) {
+                        // Code generation for this target only reads this
+                        // target's module, so it can happen in a separate
+                        // process while we go on to the next target.
+                        errorCount += lWaitForOutputProcesses(outputProcesses,
+                                                              g->numJobs - 1);
+                        pid_t pid = m->writeOutputInChild(targetOutputType,
+                                                          targetOutFileName.c_str(),
+                                                          targetIncludeFileName);
+                        if (pid > 0) {
+                            outputProcesses.push_back(pid);
+                            started = true;
+                        }
+                    }
+#endif // !ISPC_IS_WINDOWS
+                    if (!started &&
+                        !m->writeOutput(targetOutputType, targetOutFileName.c_str(),
+                                        targetIncludeFileName))
+                        return 1;
                 }
             }
             errorCount += m->errorCount;
@@ -3326,6 +3897,13 @@ Module::CompileAndOutput(const char *srcFile,
             // we generate the dispatch module's functions...
         }
 
+#ifndef ISPC_IS_WINDOWS
+        errorCount += lWaitForOutputProcesses(outputProcesses, 0);
+#endif // !ISPC_IS_WINDOWS
+
+        lSharedPreprocessorState = SHARED_PP_DISABLED;
+        lSharedPreprocessorOutput.clear();
+
         // Find the first non-NULL target machine from the targets we
         // compiled to above.  We'll use this as the target machine for
         // compiling the dispatch module--this is safe in that it is the
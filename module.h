@@ -47,6 +47,9 @@
 #if !defined(LLVM_3_2) && !defined(LLVM_3_3) && !defined(LLVM_3_4) // LLVM 3.5+
   #include <llvm/IR/DebugInfo.h>
 #endif
+#ifndef ISPC_IS_WINDOWS
+  #include <sys/types.h>
+#endif
 
 namespace llvm
 {
@@ -58,8 +61,17 @@ struct DispatchHeaderInfo;
 class Module {
 public:
     /** The name of the source file being compiled should be passed as the
-        module name. */
-    Module(const char *filename);
+        module name.  If source is non-NULL, it gives the program text to
+        compile in place of the file's contents; filename is then only
+        used to name the module in diagnostics. */
+    Module(const char *filename, const char *source = NULL);
+
+    /** Frees the symbol table and the AST, along with all of the AST nodes
+        and symbols allocated since the Module was created.  The
+        llvm::Module isn't freed; the caller may still be using it.
+        (Type objects aren't freed either, since the predefined types
+        cache pointers to types derived from them.) */
+    ~Module();
 
     /** Compiles the source file passed to the Module constructor, adding
         its global variables and functions to both the llvm::Module and
@@ -148,6 +160,22 @@ public:
                                 const char *hostStubFileName,
                                 const char *devStubFileName);
 
+    /** Computes the key for the compilation cache for the given
+        compilation from the preprocessed source for each of the targets
+        and the compilation options, and also returns the names of all
+        of the output files it may generate.  Returns false if the
+        compilation can't be cached. */
+    static bool GetCacheKey(const char *srcFile, const char *arch,
+                            const char *cpu, const char *targets,
+                            bool generatePIC,
+                            const char *outFileName,
+                            const char *headerFileName,
+                            const char *depsFileName,
+                            const char *hostStubFileName,
+                            const char *devStubFileName,
+                            std::string *key,
+                            std::vector<std::string> *outputFiles);
+
     /** Total number of errors encountered during compilation. */
     int errorCount;
 
@@ -158,6 +186,10 @@ public:
     /** llvm Module object into which globals and functions are added. */
     llvm::Module *module;
 
+    /** True while the standard library's definitions are being parsed
+        by DefineStdlib(). */
+    bool parsingStdlib;
+
     /** The diBuilder manages generating debugging information */
     llvm::DIBuilder *diBuilder;
 
@@ -169,8 +201,26 @@ public:
 
 private:
     const char *filename;
+    const char *source;
     AST *ast;
 
+    /** Markers for the first AST node and symbol allocated for this
+        module; see FreeASTNodes() and FreeSymbols(). */
+    size_t firstASTNode, firstSymbol;
+
+    /** Does the work of CompileAndOutput(), without using the
+        compilation cache. */
+    static int compileAndOutput(const char *srcFile, const char *arch,
+                                const char *cpu, const char *targets,
+                                bool generatePIC,
+                                OutputType outputType,
+                                const char *outFileName,
+                                const char *headerFileName,
+                                const char *includeFileName,
+                                const char *depsFileName,
+                                const char *hostStubFileName,
+                                const char *devStubFileName);
+
     std::vector<std::pair<const Type *, SourcePos> > exportedTypes;
 
     /** Write the corresponding output type to the given file.  Returns
@@ -180,6 +230,13 @@ private:
     bool writeOutput(OutputType ot, const char *filename,
                      const char *includeFileName = NULL,
                      DispatchHeaderInfo *DHI = 0);
+#ifndef ISPC_IS_WINDOWS
+    /** Calls writeOutput() from a child process, returning the child's
+        process id, or -1 if it couldn't be started.  The child's exit
+        status is zero if writing the output succeeded. */
+    pid_t writeOutputInChild(OutputType ot, const char *filename,
+                             const char *includeFileName);
+#endif
     bool writeHeader(const char *filename);
     bool writeDispatchHeader(DispatchHeaderInfo *DHI);
     bool writeDeps(const char *filename);
@@ -191,7 +248,22 @@ private:
                                           const char *outFileName);
     static bool writeBitcode(llvm::Module *module, const char *outFileName);
 
-    void execPreprocessor(const char *infilename, llvm::raw_string_ostream* ostream) const;
+    /** Runs the preprocessor on the given file.  If defineTargetMacros is
+        false, the macros that describe the compilation target (e.g.
+        ISPC_TARGET_AVX) aren't defined.  Returns true if the source refers
+        to any of those macros, so that its preprocessed form may differ
+        from one target to another.  If diagnostics is non-NULL, warnings
+        and errors are appended to it rather than being printed. */
+    bool execPreprocessor(const char *infilename, llvm::raw_string_ostream* ostream,
+                          bool defineTargetMacros = true,
+                          bool printDiagnostics = true,
+                          std::string *diagnostics = NULL) const;
+
+    /** For multi-target compilation, provides preprocessed source that is
+        shared by all of the targets, if possible.  Returns false if the
+        caller needs to run the preprocessor for the current target. */
+    bool getSharedPreprocessorOutput(const char *infilename,
+                                     std::string *output) const;
 };
 
 #endif // ISPC_MODULE_H
@@ -46,6 +46,7 @@
 #include <stdio.h>
 #include <map>
 #include <set>
+#include <algorithm>
 
 #include <llvm/Pass.h>
 #if defined(LLVM_3_2)
@@ -109,7 +110,15 @@
 #endif
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Analysis/Passes.h>
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/PostDominators.h>
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4)
+  #include <llvm/Analysis/Dominators.h>
+#else // LLVM 3.5+
+  #include <llvm/IR/Dominators.h>
+#endif
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Support/Dwarf.h>
 #if !defined(LLVM_3_2) && !defined(LLVM_3_3) && !defined(LLVM_3_4) && !defined(LLVM_3_5)
   #include <llvm/IR/IntrinsicInst.h>
@@ -133,13 +142,17 @@
 static llvm::Pass *CreateIntrinsicsOptPass();
 static llvm::Pass *CreateInstructionSimplifyPass();
 static llvm::Pass *CreatePeepholePass();
+static llvm::Pass *CreatePromoteUniformValuesPass();
 
 static llvm::Pass *CreateImproveMemoryOpsPass();
 static llvm::Pass *CreateGatherCoalescePass();
+static llvm::Pass *CreateScatterCoalescePass();
+static llvm::Pass *CreateCrossBlockGatherCoalescePass();
 static llvm::Pass *CreateReplacePseudoMemoryOpsPass();
 
 static llvm::Pass *CreateIsCompileTimeConstantPass(bool isLastTry);
 static llvm::Pass *CreateMakeInternalFuncsStaticPass();
+static llvm::Pass *CreateRemoveUnneededBuiltinsPass();
 
 static llvm::Pass *CreateDebugPass(char * output);
 
@@ -518,6 +531,10 @@ Optimize(llvm::Module *module, int optLevel) {
         printf("*** Code going into optimization ***\n");
         module->dump();
     }
+    // LLVM's pass managers time each pass that they run when this is set;
+    // the report is printed after the passes below have run.
+    llvm::TimePassesIsEnabled = g->timePasses;
+
     DebugPassManager optPM;
     optPM.add(llvm::createVerifierPass(),0);
 
@@ -551,6 +568,7 @@ Optimize(llvm::Module *module, int optLevel) {
 #endif
 
     optPM.add(llvm::createIndVarSimplifyPass());
+    optPM.add(CreateRemoveUnneededBuiltinsPass());
 
     if (optLevel == 0) {
         // This is more or less the minimum set of optimizations that we
@@ -678,17 +696,24 @@ Optimize(llvm::Module *module, int optLevel) {
             optPM.add(CreateInstructionSimplifyPass());
         }
 
+        if (g->opt.disableUniformPromotion == false &&
+            g->target->getVectorWidth() > 1)
+            optPM.add(CreatePromoteUniformValuesPass(), 252);
+
         if (g->opt.disableGatherScatterOptimizations == false &&
             g->target->getVectorWidth() > 1) {
             optPM.add(llvm::createInstructionCombiningPass(), 255);
             optPM.add(CreateImproveMemoryOpsPass());
 
             if (g->opt.disableCoalescing == false &&
+                g->opt.reducedPipeline == false &&
                 g->target->getISA() != Target::GENERIC) {
                 // It is important to run this here to make it easier to
                 // finding matching gathers we can coalesce..
                 optPM.add(llvm::createEarlyCSEPass(), 260);
                 optPM.add(CreateGatherCoalescePass());
+                optPM.add(CreateCrossBlockGatherCoalescePass());
+                optPM.add(CreateScatterCoalescePass());
             }
         }
 
@@ -722,31 +747,41 @@ Optimize(llvm::Module *module, int optLevel) {
         optPM.add(CreateInstructionSimplifyPass());
         optPM.add(llvm::createCFGSimplificationPass());
         optPM.add(llvm::createReassociatePass());
-        optPM.add(llvm::createLoopRotatePass());
-        optPM.add(llvm::createLICMPass());
-        optPM.add(llvm::createLoopUnswitchPass(false));
-        optPM.add(llvm::createInstructionCombiningPass());
-        optPM.add(CreateInstructionSimplifyPass());
-        optPM.add(llvm::createIndVarSimplifyPass());
-        optPM.add(llvm::createLoopIdiomPass());
-        optPM.add(llvm::createLoopDeletionPass());
-        if (g->opt.unrollLoops) {
-            optPM.add(llvm::createLoopUnrollPass(), 300);
+
+        // The loop optimizations and the global scalar optimizations that
+        // follow them are the most expensive part of the pipeline; -Os
+        // skips them.  The phases after each of the skipped ranges are
+        // numbered explicitly so that --debug-phase and --off-phase
+        // numbers are the same with and without -Os.
+        if (g->opt.reducedPipeline == false) {
+            optPM.add(llvm::createLoopRotatePass());
+            optPM.add(llvm::createLICMPass());
+            optPM.add(llvm::createLoopUnswitchPass(false));
+            optPM.add(llvm::createInstructionCombiningPass());
+            optPM.add(CreateInstructionSimplifyPass());
+            optPM.add(llvm::createIndVarSimplifyPass());
+            optPM.add(llvm::createLoopIdiomPass());
+            optPM.add(llvm::createLoopDeletionPass());
+            if (g->opt.unrollLoops) {
+                optPM.add(llvm::createLoopUnrollPass(), 300);
+            }
+            optPM.add(llvm::createGVNPass(), 301);
         }
-        optPM.add(llvm::createGVNPass(), 301);
 
-        optPM.add(CreateIsCompileTimeConstantPass(true));
+        optPM.add(CreateIsCompileTimeConstantPass(true), 302);
         optPM.add(CreateIntrinsicsOptPass());
         optPM.add(CreateInstructionSimplifyPass());
 
-        optPM.add(llvm::createMemCpyOptPass());
-        optPM.add(llvm::createSCCPPass());
-        optPM.add(llvm::createInstructionCombiningPass());
-        optPM.add(CreateInstructionSimplifyPass());
-        optPM.add(llvm::createJumpThreadingPass());
-        optPM.add(llvm::createCorrelatedValuePropagationPass());
-        optPM.add(llvm::createDeadStoreEliminationPass());
-        optPM.add(llvm::createAggressiveDCEPass());
+        if (g->opt.reducedPipeline == false) {
+            optPM.add(llvm::createMemCpyOptPass());
+            optPM.add(llvm::createSCCPPass());
+            optPM.add(llvm::createInstructionCombiningPass());
+            optPM.add(CreateInstructionSimplifyPass());
+            optPM.add(llvm::createJumpThreadingPass());
+            optPM.add(llvm::createCorrelatedValuePropagationPass());
+            optPM.add(llvm::createDeadStoreEliminationPass());
+        }
+        optPM.add(llvm::createAggressiveDCEPass(), 312);
         optPM.add(llvm::createCFGSimplificationPass());
         optPM.add(llvm::createInstructionCombiningPass());
         optPM.add(CreateInstructionSimplifyPass());
@@ -874,6 +909,9 @@ Optimize(llvm::Module *module, int optLevel) {
     optPM.add(llvm::createVerifierPass(), LAST_OPT_NUMBER);
     optPM.run(*module);
 
+    if (g->timePasses)
+        llvm::TimerGroup::printAll(llvm::errs());
+
     if (g->debugPrint) {
         printf("\n*****\nFINAL OUTPUT\n*****\n");
         module->dump();
@@ -1367,6 +1405,289 @@ CreateInstructionSimplifyPass() {
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// PromoteUniformValuesPass
+
+/** The front-end emits vector code for everything that isn't declared
+    'uniform', even though many varying values in practice have the same
+    value in all of the program instances: values loaded through uniform
+    pointers and then assigned to varying variables, the results of the
+    reduce_*() functions, arithmetic on these, and so forth.  This pass
+    finds vector arithmetic, comparisons, casts, and selects whose
+    elements can be shown to all be equal and rewrites them to do the
+    computation in scalar form and then broadcast the result.  It also
+    turns MOVMSK operations on such values into scalar tests, so that
+    branches on "any" or "all" of a lane-invariant condition become
+    regular uniform branches.
+
+    Gathers and scatters with lane-invariant offsets are turned into
+    scalar loads and stores by the ImproveMemoryOps pass, which runs
+    after this one.
+ */
+class PromoteUniformValuesPass : public llvm::BasicBlockPass {
+public:
+    PromoteUniformValuesPass();
+
+    const char *getPassName() const { return "Promote Lane-Invariant Values"; }
+    bool runOnBasicBlock(llvm::BasicBlock &BB);
+
+    static char ID;
+
+private:
+    bool promoteMovmsk(llvm::CallInst *callInst);
+    bool allEqual(llvm::Value *v);
+    void forget(llvm::Instruction *inst);
+
+    std::vector<llvm::Function *> maskFunctions;
+
+    /** Results of allEqual() and the scalar versions of the values that
+        have been scalarized so far in the current basic block. */
+    std::map<llvm::Value *, bool> allEqualCache;
+    std::map<llvm::Value *, llvm::Value *> scalarMap;
+};
+
+char PromoteUniformValuesPass::ID = 0;
+
+
+PromoteUniformValuesPass::PromoteUniformValuesPass()
+    : BasicBlockPass(ID) {
+    llvm::Intrinsic::ID ids[] = {
+        llvm::Intrinsic::x86_sse_movmsk_ps,
+        llvm::Intrinsic::x86_sse2_movmsk_pd,
+        llvm::Intrinsic::x86_sse2_pmovmskb_128,
+        llvm::Intrinsic::x86_avx_movmsk_ps_256,
+        llvm::Intrinsic::x86_avx_movmsk_pd_256,
+    };
+    for (unsigned int i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        llvm::Function *func =
+            m->module->getFunction(llvm::Intrinsic::getName(ids[i]));
+        if (func != NULL)
+            maskFunctions.push_back(func);
+    }
+    if (llvm::Function *func = m->module->getFunction("__movmsk"))
+        maskFunctions.push_back(func);
+}
+
+
+/** Returns true if the given value is a vector-typed instruction of one of
+    the kinds that LLVMExtractFirstVectorElement() can rewrite in scalar
+    form. */
+static bool
+lIsScalarizable(llvm::Value *v) {
+    llvm::VectorType *vt = llvm::dyn_cast<llvm::VectorType>(v->getType());
+    if (vt == NULL)
+        return false;
+
+    if (llvm::isa<llvm::BinaryOperator>(v) ||
+        llvm::isa<llvm::CmpInst>(v) ||
+        llvm::isa<llvm::SelectInst>(v))
+        return true;
+
+    // Casts that change the number of elements can't be done on a
+    // single element.
+    llvm::CastInst *cast = llvm::dyn_cast<llvm::CastInst>(v);
+    if (cast != NULL) {
+        llvm::VectorType *srcType =
+            llvm::dyn_cast<llvm::VectorType>(cast->getOperand(0)->getType());
+        return (srcType != NULL &&
+                srcType->getNumElements() == vt->getNumElements());
+    }
+    return false;
+}
+
+
+/** Returns true if all of the elements of the given vector value are
+    known to be equal.  For the instructions that lIsScalarizable()
+    accepts, this follows from their operands, whose results are cached,
+    so that long chains of them are only walked once.  This gives the
+    same results as LLVMVectorValuesAllEqual().
+ */
+bool
+PromoteUniformValuesPass::allEqual(llvm::Value *v) {
+    std::map<llvm::Value *, bool>::iterator iter = allEqualCache.find(v);
+    if (iter != allEqualCache.end())
+        return iter->second;
+
+    bool result;
+    if (lIsScalarizable(v)) {
+        llvm::Instruction *inst = llvm::cast<llvm::Instruction>(v);
+        result = true;
+        for (unsigned int i = 0; i < inst->getNumOperands(); ++i) {
+            llvm::Value *op = inst->getOperand(i);
+            if (llvm::isa<llvm::VectorType>(op->getType()) && !allEqual(op)) {
+                result = false;
+                break;
+            }
+        }
+        // Right shifts may give equal results even when their operands
+        // differ; leave those to LLVMVectorValuesAllEqual().
+        if (result == false &&
+            (inst->getOpcode() == llvm::Instruction::AShr ||
+             inst->getOpcode() == llvm::Instruction::LShr))
+            result = LLVMVectorValuesAllEqual(v);
+    }
+    else
+        result = LLVMVectorValuesAllEqual(v);
+
+    allEqualCache[v] = result;
+    return result;
+}
+
+
+/** Forgets anything cached about the given instruction, which is about
+    to be erased. */
+void
+PromoteUniformValuesPass::forget(llvm::Instruction *inst) {
+    allEqualCache.erase(inst);
+    scalarMap.erase(inst);
+}
+
+
+/** Returns a vector with the given scalar value in each of its 'count'
+    elements, computed immediately before the given instruction. */
+static llvm::Value *
+lBroadcast(llvm::Value *scalar, int count, llvm::Instruction *insertBefore) {
+    llvm::Type *vecType = llvm::VectorType::get(scalar->getType(), count);
+    llvm::Value *undef = llvm::UndefValue::get(vecType);
+    llvm::Value *vec =
+        llvm::InsertElementInst::Create(undef, scalar, LLVMInt32(0),
+                                        LLVMGetName(scalar, "_vec"),
+                                        insertBefore);
+    llvm::Constant *zeros = llvm::ConstantAggregateZero::get(
+        llvm::VectorType::get(LLVMTypes::Int32Type, count));
+    return new llvm::ShuffleVectorInst(vec, undef, zeros,
+                                       LLVMGetName(scalar, "_smear"),
+                                       insertBefore);
+}
+
+
+bool
+PromoteUniformValuesPass::promoteMovmsk(llvm::CallInst *callInst) {
+    llvm::Function *func = callInst->getCalledFunction();
+    if (func == NULL ||
+        std::find(maskFunctions.begin(), maskFunctions.end(), func) ==
+            maskFunctions.end())
+        return false;
+
+    // Compile-time constant masks are handled by IntrinsicsOpt and
+    // InstructionSimplify.
+    llvm::Value *mask = callInst->getArgOperand(0);
+    llvm::VectorType *vt = llvm::dyn_cast<llvm::VectorType>(mask->getType());
+    if (vt == NULL || llvm::isa<llvm::Constant>(mask) ||
+        allEqual(mask) == false)
+        return false;
+
+    // All of the elements are the same, so the result is either zero or
+    // has the bit set for every element, depending on the high bit of the
+    // first one.
+    llvm::Value *elt = LLVMExtractFirstVectorElement(mask, scalarMap);
+    llvm::Value *isOn = elt;
+    if (elt->getType() != LLVMTypes::BoolType) {
+        if (elt->getType()->isIntegerTy() == false)
+            elt = new llvm::BitCastInst(elt,
+                      llvm::IntegerType::get(*g->ctx,
+                          elt->getType()->getPrimitiveSizeInBits()),
+                      LLVMGetName(elt, "_int"), callInst);
+        isOn = new llvm::ICmpInst(callInst, llvm::CmpInst::ICMP_SLT, elt,
+                                  llvm::Constant::getNullValue(elt->getType()),
+                                  LLVMGetName(elt, "_on"));
+    }
+
+    int count = vt->getNumElements();
+    uint64_t allOn = (count >= 64) ? ~0ull : ((1ull << count) - 1);
+    llvm::Instruction *result =
+        llvm::SelectInst::Create(isOn,
+                                 llvm::ConstantInt::get(callInst->getType(), allOn),
+                                 llvm::Constant::getNullValue(callInst->getType()),
+                                 callInst->getName());
+    forget(callInst);
+    llvm::ReplaceInstWithInst(callInst, result);
+    return true;
+}
+
+
+bool
+PromoteUniformValuesPass::runOnBasicBlock(llvm::BasicBlock &bb) {
+    DEBUG_START_PASS("PromoteUniformValuesPass");
+
+    allEqualCache.clear();
+    scalarMap.clear();
+
+    // Instructions are only inserted before the one being looked at and
+    // only it is erased, so a single pass over the block suffices.
+    bool modifiedAny = false;
+    llvm::BasicBlock::iterator next;
+    for (llvm::BasicBlock::iterator iter = bb.begin(); iter != bb.end();
+         iter = next) {
+        next = iter;
+        ++next;
+        llvm::Instruction *inst = &*iter;
+
+        llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(inst);
+        if (callInst != NULL) {
+            if (promoteMovmsk(callInst))
+                modifiedAny = true;
+            continue;
+        }
+
+        if (lIsScalarizable(inst) == false)
+            continue;
+
+        // Leave computations on compile-time constants to constant
+        // folding.
+        bool allConstant = true;
+        for (unsigned int i = 0; i < inst->getNumOperands(); ++i)
+            if (llvm::isa<llvm::Constant>(inst->getOperand(i)) == false)
+                allConstant = false;
+        if (allConstant)
+            continue;
+
+        if (allEqual(inst) == false)
+            continue;
+
+        // Only rewrite the last lane-invariant value in a chain of them
+        // (the one whose value is used by something other than more
+        // lane-invariant computation); LLVMExtractFirstVectorElement()
+        // scalarizes the whole chain that leads to it, reusing the parts
+        // that were already scalarized for earlier values.
+        bool isLast = false;
+        for (llvm::Value::use_iterator ui = inst->use_begin(),
+                 ue = inst->use_end(); ui != ue; ++ui) {
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4)
+            llvm::Value *user = *ui;
+#else // LLVM 3.5+
+            llvm::Value *user = ui->getUser();
+#endif
+            if (lIsScalarizable(user) == false ||
+                allEqual(user) == false) {
+                isLast = true;
+                break;
+            }
+        }
+        if (isLast == false)
+            continue;
+
+        int count = llvm::cast<llvm::VectorType>(inst->getType())->getNumElements();
+        llvm::Value *scalar = LLVMExtractFirstVectorElement(inst, scalarMap);
+        llvm::Value *smear = lBroadcast(scalar, count, inst);
+        inst->replaceAllUsesWith(smear);
+        forget(inst);
+        inst->eraseFromParent();
+        modifiedAny = true;
+    }
+
+    DEBUG_END_PASS("PromoteUniformValuesPass");
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreatePromoteUniformValuesPass() {
+    return new PromoteUniformValuesPass;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // ImproveMemoryOpsPass
 
@@ -2721,6 +3042,215 @@ lGetOffsetScaleVec(llvm::Value *offsetScale, llvm::Type *vecType) {
 }
 
 
+/** Apply the given binary operator to two scalar values, folding the
+    result to a constant when both of them are constants. */
+static llvm::Value *
+lStrideBinop(llvm::Instruction::BinaryOps op, llvm::Value *a, llvm::Value *b,
+             llvm::Instruction *insertBefore) {
+    llvm::Constant *ca = llvm::dyn_cast<llvm::Constant>(a);
+    llvm::Constant *cb = llvm::dyn_cast<llvm::Constant>(b);
+    if (ca != NULL && cb != NULL)
+        return llvm::ConstantExpr::get(op, ca, cb);
+    return llvm::BinaryOperator::Create(op, a, b, "stride", insertBefore);
+}
+
+
+/** Returns true if lEmitUniformStride() can compute the stride of the
+    given vector of offsets.  Checking this first means that no
+    instructions are emitted for offsets that turn out not to match.
+ */
+static bool
+lHasUniformStride(llvm::Value *v, int depth = 0) {
+    if (depth > 8)
+        return false;
+
+    if (LLVMVectorValuesAllEqual(v))
+        return true;
+
+    if (llvm::isa<llvm::ConstantVector>(v) ||
+        llvm::isa<llvm::ConstantDataVector>(v)) {
+        int64_t elts[ISPC_MAX_NVEC];
+        int nElts;
+        if (!LLVMExtractVectorInts(v, elts, &nElts) || nElts < 2)
+            return false;
+        for (int i = 2; i < nElts; ++i)
+            if (elts[i] - elts[i-1] != elts[1] - elts[0])
+                return false;
+        return true;
+    }
+
+    llvm::SExtInst *sext = llvm::dyn_cast<llvm::SExtInst>(v);
+    if (sext != NULL)
+        return lHasUniformStride(sext->getOperand(0), depth + 1);
+
+    llvm::BinaryOperator *bop = llvm::dyn_cast<llvm::BinaryOperator>(v);
+    if (bop == NULL)
+        return false;
+
+    llvm::Value *op0 = bop->getOperand(0), *op1 = bop->getOperand(1);
+    switch (bop->getOpcode()) {
+    case llvm::Instruction::Add:
+    case llvm::Instruction::Sub:
+        return (lHasUniformStride(op0, depth + 1) &&
+                lHasUniformStride(op1, depth + 1));
+    case llvm::Instruction::Mul:
+        if (LLVMVectorValuesAllEqual(op1))
+            std::swap(op0, op1);
+        return (LLVMVectorValuesAllEqual(op0) &&
+                lHasUniformStride(op1, depth + 1));
+    case llvm::Instruction::Shl:
+        return (LLVMVectorValuesAllEqual(op1) &&
+                lHasUniformStride(op0, depth + 1));
+    default:
+        return false;
+    }
+}
+
+
+/** Emits the code to compute the stride s of a vector of offsets of the
+    form <o, o+s, o+2s, ...>; lHasUniformStride() must have returned true
+    for it.
+ */
+static llvm::Value *
+lEmitUniformStride(llvm::Value *v, llvm::Instruction *insertBefore,
+                   int depth = 0) {
+    if (depth > 8)
+        return NULL;
+
+    llvm::VectorType *vt = llvm::dyn_cast<llvm::VectorType>(v->getType());
+    Assert(vt != NULL);
+    llvm::Type *scalarType = vt->getElementType();
+
+    if (LLVMVectorValuesAllEqual(v))
+        return llvm::ConstantInt::get(scalarType, 0);
+
+    if (llvm::isa<llvm::ConstantVector>(v) ||
+        llvm::isa<llvm::ConstantDataVector>(v)) {
+        int64_t elts[ISPC_MAX_NVEC];
+        int nElts;
+        if (!LLVMExtractVectorInts(v, elts, &nElts) || nElts < 2)
+            return NULL;
+        for (int i = 2; i < nElts; ++i)
+            if (elts[i] - elts[i-1] != elts[1] - elts[0])
+                return NULL;
+        return llvm::ConstantInt::get(scalarType, elts[1] - elts[0]);
+    }
+
+    llvm::SExtInst *sext = llvm::dyn_cast<llvm::SExtInst>(v);
+    if (sext != NULL) {
+        llvm::Value *s = lEmitUniformStride(sext->getOperand(0), insertBefore,
+                                           depth + 1);
+        if (s == NULL)
+            return NULL;
+        if (llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(s))
+            return llvm::ConstantExpr::getSExt(c, scalarType);
+        return new llvm::SExtInst(s, scalarType, "stride_sext", insertBefore);
+    }
+
+    llvm::BinaryOperator *bop = llvm::dyn_cast<llvm::BinaryOperator>(v);
+    if (bop == NULL)
+        return NULL;
+
+    llvm::Value *op0 = bop->getOperand(0), *op1 = bop->getOperand(1);
+    switch (bop->getOpcode()) {
+    case llvm::Instruction::Add:
+    case llvm::Instruction::Sub: {
+        llvm::Value *s0 = lEmitUniformStride(op0, insertBefore, depth + 1);
+        if (s0 == NULL)
+            return NULL;
+        llvm::Value *s1 = lEmitUniformStride(op1, insertBefore, depth + 1);
+        if (s1 == NULL)
+            return NULL;
+        return lStrideBinop(bop->getOpcode(), s0, s1, insertBefore);
+    }
+    case llvm::Instruction::Mul: {
+        // One side needs to be the same across all of the lanes; the
+        // stride is then that value times the stride of the other side.
+        if (LLVMVectorValuesAllEqual(op1))
+            std::swap(op0, op1);
+        if (!LLVMVectorValuesAllEqual(op0))
+            return NULL;
+        llvm::Value *s1 = lEmitUniformStride(op1, insertBefore, depth + 1);
+        if (s1 == NULL)
+            return NULL;
+        return lStrideBinop(llvm::Instruction::Mul,
+                            LLVMExtractFirstVectorElement(op0), s1,
+                            insertBefore);
+    }
+    case llvm::Instruction::Shl: {
+        if (!LLVMVectorValuesAllEqual(op1))
+            return NULL;
+        llvm::Value *s0 = lEmitUniformStride(op0, insertBefore, depth + 1);
+        if (s0 == NULL)
+            return NULL;
+        return lStrideBinop(llvm::Instruction::Shl, s0,
+                            LLVMExtractFirstVectorElement(op1), insertBefore);
+    }
+    default:
+        return NULL;
+    }
+}
+
+
+/** Given a vector of offsets, see if it has the form <o, o+s, o+2s, ...>
+    for some scalar s that is the same for all lanes but that may only be
+    known at runtime (e.g. programIndex * stride for a uniform stride).
+    If so, the scalar value of s is returned; otherwise NULL is returned.
+ */
+static llvm::Value *
+lGetUniformStride(llvm::Value *v, llvm::Instruction *insertBefore) {
+    if (!lHasUniformStride(v))
+        return NULL;
+    llvm::Value *stride = lEmitUniformStride(v, insertBefore);
+    Assert(stride != NULL);
+    return stride;
+}
+
+
+/** Emit the loads and shuffles for a gather with an all-on mask whose
+    offsets are a small constant stride (in elements) apart.  We issue
+    "stride" vector loads that together cover every element from the one
+    read by the first lane through the one read by the last lane, then
+    shuffle out the elements needed for each lane.  The last load is
+    shifted back so that it ends exactly at the last lane's element; this
+    way we never touch memory that the original gather wouldn't have.
+ */
+static llvm::Value *
+lEmitStridedLoads(llvm::Value *ptr, int stride, int elementSize, int align,
+                  llvm::Type *vecType, llvm::Instruction *insertBefore) {
+    int width = g->target->getVectorWidth();
+    Assert(stride > 1 && stride <= width);
+
+    llvm::Type *vecPtrType = llvm::PointerType::get(vecType, 0);
+    std::vector<int> starts;
+    std::vector<llvm::Value *> loads;
+    for (int c = 0; c < stride; ++c) {
+        int start = (c == stride - 1) ? (width - 1) * (stride - 1) : c * width;
+        llvm::Value *loadPtr = lGEPInst(ptr, LLVMInt64(start * elementSize),
+                                        "strided_base", insertBefore);
+        loadPtr = new llvm::BitCastInst(loadPtr, vecPtrType, "ptr_cast",
+                                        insertBefore);
+        starts.push_back(start);
+        loads.push_back(new llvm::LoadInst(loadPtr, "strided_load",
+                                           false /* not volatile */,
+                                           align, insertBefore));
+    }
+
+    llvm::Value *result = llvm::UndefValue::get(vecType);
+    for (int c = 0; c < stride; ++c) {
+        int32_t shuf[ISPC_MAX_NVEC];
+        for (int lane = 0; lane < width; ++lane) {
+            int elt = lane * stride;
+            int chunk = std::min(elt / width, stride - 1);
+            shuf[lane] = (chunk == c) ? (width + elt - starts[c]) : lane;
+        }
+        result = LLVMShuffleVectors(result, loads[c], shuf, width,
+                                    insertBefore);
+    }
+    return result;
+}
+
+
 /** After earlier optimization passes have run, we are sometimes able to
     determine that gathers/scatters are actually accessing memory in a more
     regular fashion and then change the operation to something simpler and
@@ -2729,27 +3259,30 @@ lGetOffsetScaleVec(llvm::Value *offsetScale, llvm::Type *vecType) {
     broadcast.  This pass examines gathers and scatters and tries to
     simplify them if at all possible.
 
-    @todo Currently, this only looks for all program instances going to the
-    same location and all going to a linear sequence of locations in
-    memory.  There are a number of other cases that might make sense to
-    look for, including things that could be handled with a vector load +
-    shuffle or things that could be handled with hybrids of e.g. 2 4-wide
-    vector loads with AVX, etc.
+    Besides all program instances going to the same location and all
+    going to a linear sequence of locations in memory, this also handles
+    gathers with small constant strides (as a few vector loads and
+    shuffles) and, on targets without native gathers/scatters, accesses
+    with any stride that's the same for all lanes (with the target's
+    __gather_strided / __scatter_strided functions).
 */
 static bool
 lGSToLoadStore(llvm::CallInst *callInst) {
     struct GatherImpInfo {
-        GatherImpInfo(const char *pName, const char *lmName, llvm::Type *st,
-                      int a)
+        GatherImpInfo(const char *pName, const char *lmName, const char *sName,
+                      llvm::Type *st, int a)
             : align(a), isFactored(!g->target->hasGather()) {
             pseudoFunc = m->module->getFunction(pName);
             loadMaskedFunc = m->module->getFunction(lmName);
             Assert(pseudoFunc != NULL && loadMaskedFunc != NULL);
+            // Not all targets provide strided gathers.
+            stridedFunc = m->module->getFunction(sName);
             scalarType = st;
         }
 
         llvm::Function *pseudoFunc;
         llvm::Function *loadMaskedFunc;
+        llvm::Function *stridedFunc;
         llvm::Type *scalarType;
         const int align;
         const bool isFactored;
@@ -2758,53 +3291,68 @@ lGSToLoadStore(llvm::CallInst *callInst) {
     GatherImpInfo gInfo[] = {
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets32_i8" :
                                             "__pseudo_gather_factored_base_offsets32_i8",
-                      "__masked_load_i8", LLVMTypes::Int8Type, 1),
+                      "__masked_load_i8", "__gather_strided_i8",
+                      LLVMTypes::Int8Type, 1),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets32_i16" :
                                             "__pseudo_gather_factored_base_offsets32_i16",
-                      "__masked_load_i16", LLVMTypes::Int16Type, 2),
+                      "__masked_load_i16", "__gather_strided_i16",
+                      LLVMTypes::Int16Type, 2),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets32_i32" :
                                             "__pseudo_gather_factored_base_offsets32_i32",
-                      "__masked_load_i32", LLVMTypes::Int32Type, 4),
+                      "__masked_load_i32", "__gather_strided_i32",
+                      LLVMTypes::Int32Type, 4),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets32_float" :
                                             "__pseudo_gather_factored_base_offsets32_float",
-                      "__masked_load_float", LLVMTypes::FloatType, 4),
+                      "__masked_load_float", "__gather_strided_float",
+                      LLVMTypes::FloatType, 4),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets32_i64" :
                                             "__pseudo_gather_factored_base_offsets32_i64",
-                      "__masked_load_i64", LLVMTypes::Int64Type, 8),
+                      "__masked_load_i64", "__gather_strided_i64",
+                      LLVMTypes::Int64Type, 8),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets32_double" :
                                             "__pseudo_gather_factored_base_offsets32_double",
-                      "__masked_load_double", LLVMTypes::DoubleType, 8),
+                      "__masked_load_double", "__gather_strided_double",
+                      LLVMTypes::DoubleType, 8),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets64_i8" :
                                             "__pseudo_gather_factored_base_offsets64_i8",
-                      "__masked_load_i8", LLVMTypes::Int8Type, 1),
+                      "__masked_load_i8", "__gather_strided_i8",
+                      LLVMTypes::Int8Type, 1),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets64_i16" :
                                             "__pseudo_gather_factored_base_offsets64_i16",
-                      "__masked_load_i16", LLVMTypes::Int16Type, 2),
+                      "__masked_load_i16", "__gather_strided_i16",
+                      LLVMTypes::Int16Type, 2),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets64_i32" :
                                             "__pseudo_gather_factored_base_offsets64_i32",
-                      "__masked_load_i32", LLVMTypes::Int32Type, 4),
+                      "__masked_load_i32", "__gather_strided_i32",
+                      LLVMTypes::Int32Type, 4),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets64_float" :
                                             "__pseudo_gather_factored_base_offsets64_float",
-                       "__masked_load_float", LLVMTypes::FloatType, 4),
+                       "__masked_load_float", "__gather_strided_float",
+                      LLVMTypes::FloatType, 4),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets64_i64" :
                                             "__pseudo_gather_factored_base_offsets64_i64",
-                      "__masked_load_i64", LLVMTypes::Int64Type, 8),
+                      "__masked_load_i64", "__gather_strided_i64",
+                      LLVMTypes::Int64Type, 8),
         GatherImpInfo(g->target->hasGather() ? "__pseudo_gather_base_offsets64_double" :
                                             "__pseudo_gather_factored_base_offsets64_double",
-                      "__masked_load_double", LLVMTypes::DoubleType, 8),
+                      "__masked_load_double", "__gather_strided_double",
+                      LLVMTypes::DoubleType, 8),
     };
 
     struct ScatterImpInfo {
-        ScatterImpInfo(const char *pName, const char *msName,
+        ScatterImpInfo(const char *pName, const char *msName, const char *sName,
                        llvm::Type *vpt, int a)
             : align(a), isFactored(!g->target->hasScatter()) {
             pseudoFunc = m->module->getFunction(pName);
             maskedStoreFunc = m->module->getFunction(msName);
             vecPtrType = vpt;
             Assert(pseudoFunc != NULL && maskedStoreFunc != NULL);
+            // Not all targets provide strided scatters.
+            stridedFunc = m->module->getFunction(sName);
         }
         llvm::Function *pseudoFunc;
         llvm::Function *maskedStoreFunc;
+        llvm::Function *stridedFunc;
         llvm::Type *vecPtrType;
         const int align;
         const bool isFactored;
@@ -2813,40 +3361,52 @@ lGSToLoadStore(llvm::CallInst *callInst) {
     ScatterImpInfo sInfo[] = {
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets32_i8" :
                                               "__pseudo_scatter_factored_base_offsets32_i8",
-                       "__pseudo_masked_store_i8", LLVMTypes::Int8VectorPointerType, 1),
+                       "__pseudo_masked_store_i8", "__scatter_strided_i8",
+                       LLVMTypes::Int8VectorPointerType, 1),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets32_i16" :
                                               "__pseudo_scatter_factored_base_offsets32_i16",
-                       "__pseudo_masked_store_i16", LLVMTypes::Int16VectorPointerType, 2),
+                       "__pseudo_masked_store_i16", "__scatter_strided_i16",
+                       LLVMTypes::Int16VectorPointerType, 2),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets32_i32" :
                                               "__pseudo_scatter_factored_base_offsets32_i32",
-                       "__pseudo_masked_store_i32", LLVMTypes::Int32VectorPointerType, 4),
+                       "__pseudo_masked_store_i32", "__scatter_strided_i32",
+                       LLVMTypes::Int32VectorPointerType, 4),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets32_float" :
                                               "__pseudo_scatter_factored_base_offsets32_float",
-                       "__pseudo_masked_store_float", LLVMTypes::FloatVectorPointerType, 4),
+                       "__pseudo_masked_store_float", "__scatter_strided_float",
+                       LLVMTypes::FloatVectorPointerType, 4),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets32_i64" :
                                               "__pseudo_scatter_factored_base_offsets32_i64",
-                       "__pseudo_masked_store_i64", LLVMTypes::Int64VectorPointerType, 8),
+                       "__pseudo_masked_store_i64", "__scatter_strided_i64",
+                       LLVMTypes::Int64VectorPointerType, 8),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets32_double" :
                                               "__pseudo_scatter_factored_base_offsets32_double",
-                       "__pseudo_masked_store_double", LLVMTypes::DoubleVectorPointerType, 8),
+                       "__pseudo_masked_store_double", "__scatter_strided_double",
+                       LLVMTypes::DoubleVectorPointerType, 8),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets64_i8" :
                                               "__pseudo_scatter_factored_base_offsets64_i8",
-                       "__pseudo_masked_store_i8", LLVMTypes::Int8VectorPointerType, 1),
+                       "__pseudo_masked_store_i8", "__scatter_strided_i8",
+                       LLVMTypes::Int8VectorPointerType, 1),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets64_i16" :
                                               "__pseudo_scatter_factored_base_offsets64_i16",
-                       "__pseudo_masked_store_i16", LLVMTypes::Int16VectorPointerType, 2),
+                       "__pseudo_masked_store_i16", "__scatter_strided_i16",
+                       LLVMTypes::Int16VectorPointerType, 2),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets64_i32" :
                                               "__pseudo_scatter_factored_base_offsets64_i32",
-                       "__pseudo_masked_store_i32", LLVMTypes::Int32VectorPointerType, 4),
+                       "__pseudo_masked_store_i32", "__scatter_strided_i32",
+                       LLVMTypes::Int32VectorPointerType, 4),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets64_float" :
                                               "__pseudo_scatter_factored_base_offsets64_float",
-                       "__pseudo_masked_store_float", LLVMTypes::FloatVectorPointerType, 4),
+                       "__pseudo_masked_store_float", "__scatter_strided_float",
+                       LLVMTypes::FloatVectorPointerType, 4),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets64_i64" :
                                               "__pseudo_scatter_factored_base_offsets64_i64",
-                       "__pseudo_masked_store_i64", LLVMTypes::Int64VectorPointerType, 8),
+                       "__pseudo_masked_store_i64", "__scatter_strided_i64",
+                       LLVMTypes::Int64VectorPointerType, 8),
         ScatterImpInfo(g->target->hasScatter() ? "__pseudo_scatter_base_offsets64_double" :
                                               "__pseudo_scatter_factored_base_offsets64_double",
-                       "__pseudo_masked_store_double", LLVMTypes::DoubleVectorPointerType, 8),
+                       "__pseudo_masked_store_double", "__scatter_strided_double",
+                       LLVMTypes::DoubleVectorPointerType, 8),
     };
 
     llvm::Function *calledFunc = callInst->getCalledFunction();
@@ -3002,7 +3562,70 @@ lGSToLoadStore(llvm::CallInst *callInst) {
                 return true;
             }
         }
-        return false;
+
+        // Small constant strides for gathers (e.g. a[3*programIndex+k])
+        // can be done with a few vector loads and shuffles, as long as all
+        // of the lanes are active.
+        if (gatherInfo != NULL && step > 0 && lGetMaskStatus(mask) == ALL_ON) {
+            for (int stride = 2; stride <= 4; ++stride) {
+                if (stride > g->target->getVectorWidth() ||
+                    !LLVMVectorIsLinear(fullOffsets, stride * step))
+                    continue;
+
+                Debug(pos, "Transformed stride-%d gather to vector loads "
+                      "and shuffles!", stride);
+                llvm::Value *ptr = lComputeCommonPointer(base, fullOffsets, callInst);
+                lCopyMetadata(ptr, callInst);
+                llvm::Value *result =
+                    lEmitStridedLoads(ptr, stride, step, gatherInfo->align,
+                                      callInst->getType(), callInst);
+                lCopyMetadata(result, callInst);
+                callInst->replaceAllUsesWith(result);
+                callInst->eraseFromParent();
+                return true;
+            }
+        }
+
+        // Otherwise, if the stride is the same for all lanes but larger or
+        // only known at runtime, use the target's strided gather/scatter
+        // (if it has one); this is only worthwhile for targets that would
+        // otherwise emulate the gather/scatter lane by lane.
+        llvm::Function *stridedFunc = NULL;
+        if (gatherInfo != NULL && gatherInfo->isFactored)
+            stridedFunc = gatherInfo->stridedFunc;
+        else if (scatterInfo != NULL && scatterInfo->isFactored)
+            stridedFunc = scatterInfo->stridedFunc;
+        if (stridedFunc == NULL)
+            return false;
+
+        llvm::Value *stride = lGetUniformStride(fullOffsets, callInst);
+        if (stride == NULL)
+            return false;
+        if (stride->getType() != LLVMTypes::Int64Type) {
+            llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(stride);
+            if (c != NULL)
+                stride = llvm::ConstantExpr::getSExt(c, LLVMTypes::Int64Type);
+            else
+                stride = new llvm::SExtInst(stride, LLVMTypes::Int64Type,
+                                            "stride64", callInst);
+        }
+
+        llvm::Value *ptr = lComputeCommonPointer(base, fullOffsets, callInst);
+        lCopyMetadata(ptr, callInst);
+
+        llvm::Instruction *newCall;
+        if (gatherInfo != NULL) {
+            Debug(pos, "Transformed gather to strided gather!");
+            newCall = lCallInst(stridedFunc, ptr, stride, mask,
+                                LLVMGetName(ptr, "_strided_gather"));
+        }
+        else {
+            Debug(pos, "Transformed scatter to strided scatter!");
+            newCall = lCallInst(stridedFunc, ptr, stride, storeValue, mask, "");
+        }
+        lCopyMetadata(newCall, callInst);
+        llvm::ReplaceInstWithInst(callInst, newCall);
+        return true;
     }
 }
 
@@ -3095,6 +3718,89 @@ lImproveMaskedStore(llvm::CallInst *callInst) {
 }
 
 
+/** Walks back through bitcasts and GEPs with constant indices from the
+    given pointer to find the underlying pointer value, accumulating the
+    total byte offset from it into *offset.
+ */
+static llvm::Value *
+lGetPointerBaseAndOffset(llvm::Value *ptr, int64_t *offset) {
+    const llvm::DataLayout *td = g->target->getDataLayout();
+
+    while (true) {
+        llvm::User *user = NULL;
+        if (llvm::isa<llvm::BitCastInst>(ptr) ||
+            llvm::isa<llvm::GetElementPtrInst>(ptr))
+            user = llvm::cast<llvm::User>(ptr);
+        else if (llvm::ConstantExpr *ce = llvm::dyn_cast<llvm::ConstantExpr>(ptr)) {
+            if (ce->getOpcode() == llvm::Instruction::BitCast ||
+                ce->getOpcode() == llvm::Instruction::GetElementPtr)
+                user = ce;
+        }
+        if (user == NULL)
+            return ptr;
+
+        llvm::Value *src = user->getOperand(0);
+        if (user->getNumOperands() > 1) {
+            // GEP: all of the indices must be compile-time constants
+            llvm::SmallVector<llvm::Value *, 4> indices;
+            for (unsigned int i = 1; i < user->getNumOperands(); ++i) {
+                if (llvm::isa<llvm::ConstantInt>(user->getOperand(i)) == false)
+                    return ptr;
+                indices.push_back(user->getOperand(i));
+            }
+            *offset += td->getIndexedOffset(src->getType(), indices);
+        }
+        ptr = src;
+    }
+}
+
+
+/** Returns true if it can be proven that reading loadSize bytes starting
+    at the given pointer is safe, regardless of the execution mask--i.e.
+    that all of the bytes are inside a single stack or global allocation
+    whose size is known at compile time.  In that case, *align is set to
+    the alignment of the pointer that can be inferred from the
+    allocation's alignment and the offset into it, or 0 if nothing is
+    known about it.
+ */
+static bool
+lIsDereferenceable(llvm::Value *ptr, uint64_t loadSize, int *align) {
+    const llvm::DataLayout *td = g->target->getDataLayout();
+    int64_t offset = 0;
+    llvm::Value *base = lGetPointerBaseAndOffset(ptr, &offset);
+
+    uint64_t allocSize = 0;
+    unsigned int baseAlign = 0;
+    if (llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(base)) {
+        llvm::ConstantInt *count =
+            llvm::dyn_cast<llvm::ConstantInt>(alloca->getArraySize());
+        if (count == NULL || alloca->getAllocatedType()->isSized() == false)
+            return false;
+        allocSize = td->getTypeAllocSize(alloca->getAllocatedType()) *
+            count->getZExtValue();
+        baseAlign = alloca->getAlignment();
+    }
+    else if (llvm::GlobalVariable *gv =
+             llvm::dyn_cast<llvm::GlobalVariable>(base)) {
+        // External weak symbols may be NULL; declarations with unsized
+        // types (e.g. "extern uniform float a[]") have a zero size here.
+        llvm::Type *type = PTYPE(gv);
+        if (gv->hasExternalWeakLinkage() || type->isSized() == false)
+            return false;
+        allocSize = td->getTypeAllocSize(type);
+        baseAlign = gv->getAlignment();
+    }
+    else
+        return false;
+
+    if (offset < 0 || (uint64_t)offset + loadSize > allocSize)
+        return false;
+
+    *align = (baseAlign == 0) ? 0 : (int)llvm::MinAlign(baseAlign, offset);
+    return true;
+}
+
+
 static bool
 lImproveMaskedLoad(llvm::CallInst *callInst,
                    llvm::BasicBlock::iterator iter) {
@@ -3155,8 +3861,33 @@ lImproveMaskedLoad(llvm::CallInst *callInst,
         llvm::ReplaceInstWithInst(callInst, load);
         return true;
     }
-    else
+
+    // Even with a mixed mask, a regular vector load can be used if the
+    // entire vector's worth of memory is known to be accessible; the
+    // values loaded for the inactive lanes are undefined in any case.
+    int align = 0;
+    uint64_t loadSize =
+        g->target->getDataLayout()->getTypeStoreSize(callInst->getType());
+    if (lIsDereferenceable(ptr, loadSize, &align) == false)
         return false;
+
+    if (g->opt.forceAlignedMemory)
+        align = g->target->getNativeVectorAlignment();
+    else if (align < info->align)
+        align = info->align;
+
+    SourcePos pos;
+    lGetSourcePosFromMetadata(callInst, &pos);
+    Debug(pos, "Transformed masked load to regular load of dereferenceable memory.");
+    llvm::Type *ptrType = llvm::PointerType::get(callInst->getType(), 0);
+    ptr = new llvm::BitCastInst(ptr, ptrType, "ptr_cast_for_load",
+                                callInst);
+    llvm::Instruction *load =
+        new llvm::LoadInst(ptr, callInst->getName(), false /* not volatile */,
+                           align, (llvm::Instruction *)NULL);
+    lCopyMetadata(load, callInst);
+    llvm::ReplaceInstWithInst(callInst, load);
+    return true;
 }
 
 
@@ -3214,14 +3945,15 @@ CreateImproveMemoryOpsPass() {
 // GatherCoalescePass
 
 // This pass implements two optimizations to improve the performance of
-// gathers; currently only gathers of 32-bit values where it can be
-// determined at compile time that the mask is all on are supported, though
-// both of those limitations may be generalized in the future.
+// gathers of 8, 16, 32, and 64-bit values; currently only gathers where it
+// can be determined at compile time that the mask is all on are
+// supported, though that limitation may be generalized in the future.
 //
 //  First, for any single gather, see if it's worthwhile to break it into
-//  any of scalar, 2-wide (i.e. 64-bit), 4-wide, or 8-wide loads.  Further,
-//  we generate code that shuffles these loads around.  Doing fewer, larger
-//  loads in this manner, when possible, can be more efficient.
+//  any of scalar, 2-wide, 4-wide, 8-wide, or 16-wide loads (never reading
+//  more than 32 bytes with a single load).  Further, we generate code that
+//  shuffles these loads around.  Doing fewer, larger loads in this manner,
+//  when possible, can be more efficient.
 //
 //  Second, this pass can coalesce memory accesses across multiple
 //  gathers. If we have a series of gathers without any memory writes in
@@ -3265,8 +3997,8 @@ struct CoalescedLoadOp {
     /** Value loaded from memory for this load op */
     llvm::Value *load;
 
-    /** For 2-wide loads (i.e. 64-bit loads), these store the lower and
-        upper 32 bits of the result, respectively. */
+    /** For 2-wide loads, these store the lower and upper elements of the
+        result, respectively. */
     llvm::Value *element0, *element1;
 };
 
@@ -3376,10 +4108,12 @@ lVectorLoadIsEfficient(std::set<int64_t>::iterator iter,
     loaded into memory, determine a reasonable set of load operations that
     gets all of the corresponding values in memory (ideally, including as
     many as possible wider vector loads rather than scalar loads).  Return
-    a CoalescedLoadOp for each one in the *loads array.
+    a CoalescedLoadOp for each one in the *loads array.  elementSize gives
+    the size in bytes of the elements being loaded; it limits the widest
+    load that will be considered.
  */
 static void
-lSelectLoads(const std::vector<int64_t> &loadOffsets,
+lSelectLoads(const std::vector<int64_t> &loadOffsets, int elementSize,
              std::vector<CoalescedLoadOp> *loads) {
     // First, get a sorted set of unique offsets to load from.
     std::set<int64_t> allOffsets;
@@ -3398,11 +4132,15 @@ lSelectLoads(const std::vector<int64_t> &loadOffsets,
     iter = allOffsets.begin();
     while (iter != allOffsets.end()) {
         // Consider vector loads of width of each of the elements of
-        // spanSizes[], in order.
-        int vectorWidths[] = { 8, 4, 2 };
+        // vectorWidths[], in order, skipping any that would read more
+        // than 32 bytes at once.
+        int vectorWidths[] = { 16, 8, 4, 2 };
         int nVectorWidths = sizeof(vectorWidths) / sizeof(vectorWidths[0]);
         bool gotOne = false;
         for (int i = 0; i < nVectorWidths; ++i) {
+            if (vectorWidths[i] * elementSize > 32)
+                continue;
+
             // See if a load of vector with width vectorWidths[i] would be
             // effective (i.e. would cover a reasonable number of the
             // offsets that need to be loaded from).
@@ -3512,64 +4250,78 @@ lGEPAndLoad(llvm::Value *basePtr, int64_t offset, int align,
 
 /* Having decided that we're doing to emit a series of loads, as encoded in
    the loadOps array, this function emits the corresponding load
-   instructions.
+   instructions.  elementType is the integer type of the elements being
+   gathered.
  */
 static void
 lEmitLoads(llvm::Value *basePtr, std::vector<CoalescedLoadOp> &loadOps,
-           int elementSize, llvm::Instruction *insertBefore) {
+           llvm::Type *elementType, llvm::Instruction *insertBefore) {
+    int elementBits = elementType->getPrimitiveSizeInBits();
+    int elementSize = elementBits / 8;
+
     Debug(SourcePos(), "Coalesce doing %d loads.", (int)loadOps.size());
     for (int i = 0; i < (int)loadOps.size(); ++i) {
         Debug(SourcePos(), "Load #%d @ %" PRId64 ", %d items", i, loadOps[i].start,
               loadOps[i].count);
 
         // basePtr is an i8 *, so the offset from it should be in terms of
-        // bytes, not underlying i32 elements.
+        // bytes, not underlying elements.
         int64_t start = loadOps[i].start * elementSize;
 
-        int align = 4;
+        int align = (elementSize < 4) ? elementSize : 4;
         switch (loadOps[i].count) {
         case 1:
-            // Single 32-bit scalar load
+            // Single scalar load
             loadOps[i].load = lGEPAndLoad(basePtr, start, align, insertBefore,
-                                          LLVMTypes::Int32Type);
+                                          elementType);
             break;
         case 2: {
-            // Emit 2 x i32 loads as i64 loads and then break the result
-            // into two 32-bit parts.
+            if (elementSize == 8) {
+                // There's no scalar integer type twice as wide as i64 that
+                // we'd want to use here, so do a 2-wide vector load and
+                // extract the two elements from it.
+                llvm::VectorType *vt = llvm::VectorType::get(elementType, 2);
+                loadOps[i].load = lGEPAndLoad(basePtr, start, align,
+                                              insertBefore, vt);
+                loadOps[i].element0 =
+                    llvm::ExtractElementInst::Create(loadOps[i].load, LLVMInt32(0),
+                                                     "load2_elt0", insertBefore);
+                loadOps[i].element1 =
+                    llvm::ExtractElementInst::Create(loadOps[i].load, LLVMInt32(1),
+                                                     "load2_elt1", insertBefore);
+                break;
+            }
+
+            // Emit 2 x iN loads as a single i(2N) load and then break the
+            // result into two N-bit parts.
+            llvm::Type *pairType =
+                llvm::IntegerType::get(*g->ctx, 2 * elementBits);
             loadOps[i].load = lGEPAndLoad(basePtr, start, align, insertBefore,
-                                          LLVMTypes::Int64Type);
-            // element0 = (int32)value;
+                                          pairType);
+            // element0 = (intN)value;
             loadOps[i].element0 =
-                new llvm::TruncInst(loadOps[i].load, LLVMTypes::Int32Type,
-                                    "load64_elt0", insertBefore);
-            // element1 = (int32)(value >> 32)
+                new llvm::TruncInst(loadOps[i].load, elementType,
+                                    "load2_elt0", insertBefore);
+            // element1 = (intN)(value >> N)
             llvm::Value *shift =
                 llvm::BinaryOperator::Create(llvm::Instruction::LShr,
-                                             loadOps[i].load, LLVMInt64(32),
-                                             "load64_shift", insertBefore);
+                                             loadOps[i].load,
+                                             llvm::ConstantInt::get(pairType, elementBits),
+                                             "load2_shift", insertBefore);
             loadOps[i].element1 =
-                new llvm::TruncInst(shift, LLVMTypes::Int32Type,
-                                    "load64_elt1", insertBefore);
+                new llvm::TruncInst(shift, elementType,
+                                    "load2_elt1", insertBefore);
             break;
         }
-        case 4: {
-            // 4-wide vector load
-            if (g->opt.forceAlignedMemory) {
-                align = g->target->getNativeVectorAlignment();
-            }
-            llvm::VectorType *vt =
-                llvm::VectorType::get(LLVMTypes::Int32Type, 4);
-            loadOps[i].load = lGEPAndLoad(basePtr, start, align,
-                                          insertBefore, vt);
-            break;
-        }
-        case 8: {
-            // 8-wide vector load
+        case 4:
+        case 8:
+        case 16: {
+            // 4, 8, or 16-wide vector load
             if (g->opt.forceAlignedMemory) {
                 align = g->target->getNativeVectorAlignment();
             }
             llvm::VectorType *vt =
-                llvm::VectorType::get(LLVMTypes::Int32Type, 8);
+                llvm::VectorType::get(elementType, loadOps[i].count);
             loadOps[i].load = lGEPAndLoad(basePtr, start, align,
                                           insertBefore, vt);
             break;
@@ -3581,29 +4333,26 @@ lEmitLoads(llvm::Value *basePtr, std::vector<CoalescedLoadOp> &loadOps,
 }
 
 
-/** Convert any loads of 8-wide vectors into two 4-wide vectors
-    (logically).  This allows the assembly code below to always operate on
-    4-wide vectors, which leads to better code.  Returns a new vector of
-    load operations.
+/** Convert any loads of 8 or 16-wide vectors into two or four 4-wide
+    vectors (logically).  This allows the assembly code below to always
+    operate on 4-wide vectors, which leads to better code.  Returns a new
+    vector of load operations.
  */
 static std::vector<CoalescedLoadOp>
-lSplit8WideLoads(const std::vector<CoalescedLoadOp> &loadOps,
-                 llvm::Instruction *insertBefore) {
+lSplitWideLoads(const std::vector<CoalescedLoadOp> &loadOps,
+                llvm::Instruction *insertBefore) {
     std::vector<CoalescedLoadOp> ret;
     for (unsigned int i = 0; i < loadOps.size(); ++i) {
-        if (loadOps[i].count == 8) {
+        if (loadOps[i].count > 4) {
             // Create fake CoalescedLOadOps, where the load llvm::Value is
-            // actually a shuffle that pulls either the first 4 or the last
-            // 4 values out of the original 8-wide loaded value.
-            int32_t shuf[2][4] = { { 0, 1, 2, 3 }, { 4, 5, 6, 7 } };
-
-            ret.push_back(CoalescedLoadOp(loadOps[i].start, 4));
-            ret.back().load = LLVMShuffleVectors(loadOps[i].load, loadOps[i].load,
-                                                 shuf[0], 4, insertBefore);
-
-            ret.push_back(CoalescedLoadOp(loadOps[i].start+4, 4));
-            ret.back().load = LLVMShuffleVectors(loadOps[i].load, loadOps[i].load,
-                                                 shuf[1], 4, insertBefore);
+            // actually a shuffle that pulls a consecutive set of 4 values
+            // out of the original wide loaded value.
+            for (int j = 0; j < loadOps[i].count; j += 4) {
+                int32_t shuf[4] = { j, j+1, j+2, j+3 };
+                ret.push_back(CoalescedLoadOp(loadOps[i].start+j, 4));
+                ret.back().load = LLVMShuffleVectors(loadOps[i].load, loadOps[i].load,
+                                                     shuf, 4, insertBefore);
+            }
         }
         else
             ret.push_back(loadOps[i]);
@@ -3613,7 +4362,7 @@ lSplit8WideLoads(const std::vector<CoalescedLoadOp> &loadOps,
 }
 
 
-/** Given a 1-wide load of a 32-bit value, merge its value into the result
+/** Given a 1-wide load of a scalar value, merge its value into the result
     vector for any and all elements for which it applies.
  */
 static llvm::Value *
@@ -3646,12 +4395,14 @@ lApplyLoad2(llvm::Value *result, const CoalescedLoadOp &load,
             const int64_t offsets[4], bool set[4],
             llvm::Instruction *insertBefore) {
     for (int elt = 0; elt < 4; ++elt) {
-        // First, try to do a 64-bit-wide insert into the result vector.
-        // We can do this when we're currently at an even element, when the
-        // current and next element have consecutive values, and where the
-        // original 64-bit load is at the offset needed by the current
-        // element.
-        if ((elt & 1) == 0 &&
+        // First, try to do a double-width insert into the result vector.
+        // We can do this when the original load was done as a single
+        // integer twice the element size, when we're currently at an even
+        // element, when the current and next element have consecutive
+        // values, and where the original load is at the offset needed by
+        // the current element.
+        if (load.load->getType()->isIntegerTy() &&
+            (elt & 1) == 0 &&
             offsets[elt] + 1 == offsets[elt+1] &&
             offsets[elt] == load.start) {
             Debug(SourcePos(), "Load 2 @ %" PRId64 " matches for elements #%d,%d "
@@ -3659,22 +4410,21 @@ lApplyLoad2(llvm::Value *result, const CoalescedLoadOp &load,
                   offsets[elt], offsets[elt+1]);
             Assert(set[elt] == false && set[elt+1] == false);
 
-            // In this case, we bitcast from a 4xi32 to a 2xi64 vector
-            llvm::Type *vec2x64Type =
-                llvm::VectorType::get(LLVMTypes::Int64Type, 2);
-            result = new llvm::BitCastInst(result, vec2x64Type, "to2x64",
+            // In this case, we bitcast from a 4xiN to a 2xi(2N) vector
+            llvm::Type *origType = result->getType();
+            llvm::Type *vec2Type =
+                llvm::VectorType::get(load.load->getType(), 2);
+            result = new llvm::BitCastInst(result, vec2Type, "to2x",
                                            insertBefore);
 
-            // And now we can insert the 64-bit wide value into the
+            // And now we can insert the double-width value into the
             // appropriate elment
             result = llvm::InsertElementInst::Create(result, load.load,
                                                      LLVMInt32(elt/2),
-                                                     "insert64", insertBefore);
+                                                     "insert2", insertBefore);
 
-            // And back to 4xi32.
-            llvm::Type *vec4x32Type =
-                llvm::VectorType::get(LLVMTypes::Int32Type, 4);
-            result = new llvm::BitCastInst(result, vec4x32Type, "to4x32",
+            // And back to 4xiN.
+            result = new llvm::BitCastInst(result, origType, "to4x",
                                            insertBefore);
 
             set[elt] = set[elt+1] = true;
@@ -3686,7 +4436,7 @@ lApplyLoad2(llvm::Value *result, const CoalescedLoadOp &load,
                  offsets[elt] < load.start + load.count) {
             Debug(SourcePos(), "Load 2 @ %" PRId64 " matches for element #%d "
                   "(value %" PRId64 ")", load.start, elt, offsets[elt]);
-            // Otherwise, insert one of the 32-bit pieces into an element
+            // Otherwise, insert one of the two pieces into an element
             // of the final vector
             Assert(set[elt] == false);
             llvm::Value *toInsert = (offsets[elt] == load.start) ?
@@ -3751,9 +4501,9 @@ lApplyLoad4(llvm::Value *result, const CoalescedLoadOp &load,
 */
 static llvm::Value *
 lAssemble4Vector(const std::vector<CoalescedLoadOp> &loadOps,
-                 const int64_t offsets[4], llvm::Instruction *insertBefore) {
-    llvm::Type *returnType =
-        llvm::VectorType::get(LLVMTypes::Int32Type, 4);
+                 const int64_t offsets[4], llvm::Type *elementType,
+                 llvm::Instruction *insertBefore) {
+    llvm::Type *returnType = llvm::VectorType::get(elementType, 4);
     llvm::Value *result = llvm::UndefValue::get(returnType);
 
     Debug(SourcePos(), "Starting search for loads [%" PRId64 " %" PRId64 " %"
@@ -3891,9 +4641,9 @@ lApplyLoad12s(llvm::Value *result, const std::vector<CoalescedLoadOp> &loadOps,
 */
 static llvm::Value *
 lAssemble4Vector(const std::vector<CoalescedLoadOp> &loadOps,
-                 const int64_t offsets[4], llvm::Instruction *insertBefore) {
-    llvm::Type *returnType =
-        llvm::VectorType::get(LLVMTypes::Int32Type, 4);
+                 const int64_t offsets[4], llvm::Type *elementType,
+                 llvm::Instruction *insertBefore) {
+    llvm::Type *returnType = llvm::VectorType::get(elementType, 4);
     llvm::Value *result = llvm::UndefValue::get(returnType);
 
     Debug(SourcePos(), "Starting search for loads [%" PRId64 " %" PRId64 " %"
@@ -3924,6 +4674,7 @@ lAssemble4Vector(const std::vector<CoalescedLoadOp> &loadOps,
 static void
 lAssembleResultVectors(const std::vector<CoalescedLoadOp> &loadOps,
                        const std::vector<int64_t> &constOffsets,
+                       llvm::Type *elementType,
                        std::vector<llvm::Value *> &results,
                        llvm::Instruction *insertBefore) {
     // We work on 4-wide chunks of the final values, even when we're
@@ -3933,7 +4684,7 @@ lAssembleResultVectors(const std::vector<CoalescedLoadOp> &loadOps,
     std::vector<llvm::Value *> vec4s;
     for (int i = 0; i < (int)constOffsets.size(); i += 4)
         vec4s.push_back(lAssemble4Vector(loadOps, &constOffsets[i],
-                                         insertBefore));
+                                         elementType, insertBefore));
 
     // And now concatenate 1, 2, or 4 of the 4-wide vectors computed above
     // into 4, 8, or 16-wide final result vectors.
@@ -3996,9 +4747,10 @@ lComputeBasePtr(llvm::CallInst *gatherInst, llvm::Instruction *insertBefore) {
     offsets, but we'll transform them into offsets in terms of the size of
     the base scalar type being gathered.  (e.g. for an i32 gather, we might
     have offsets like <0,4,16,20>, which would be transformed to <0,1,4,5>
-    here.)
+    here.)  Returns false if any of the offsets isn't a multiple of the
+    element size, in which case the gathers can't be coalesced.
  */
-static void
+static bool
 lExtractConstOffsets(const std::vector<llvm::CallInst *> &coalesceGroup,
                      int elementSize, std::vector<int64_t> *constOffsets) {
     int width = g->target->getVectorWidth();
@@ -4012,8 +4764,12 @@ lExtractConstOffsets(const std::vector<llvm::CallInst *> &coalesceGroup,
         Assert(ok && nElts == width);
     }
 
-    for (int i = 0; i < (int)constOffsets->size(); ++i)
+    for (int i = 0; i < (int)constOffsets->size(); ++i) {
+        if (((*constOffsets)[i] % elementSize) != 0)
+            return false;
         (*constOffsets)[i] /= elementSize;
+    }
+    return true;
 }
 
 
@@ -4031,46 +4787,56 @@ static bool
 lCoalesceGathers(const std::vector<llvm::CallInst *> &coalesceGroup) {
     llvm::Instruction *insertBefore = coalesceGroup[0];
 
-    // First, compute the shared base pointer for all of the gathers
-    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
-
-    int elementSize = 0;
-    if (coalesceGroup[0]->getType() == LLVMTypes::Int32VectorType ||
-        coalesceGroup[0]->getType() == LLVMTypes::FloatVectorType)
-        elementSize = 4;
+    // All of the loads and shuffles are done with integer types of the
+    // same size as the gathered elements; the results are bitcast back to
+    // the original type (e.g. float or double) at the end.
+    llvm::Type *elementType = NULL;
+    if (coalesceGroup[0]->getType() == LLVMTypes::Int8VectorType)
+        elementType = LLVMTypes::Int8Type;
+    else if (coalesceGroup[0]->getType() == LLVMTypes::Int16VectorType)
+        elementType = LLVMTypes::Int16Type;
+    else if (coalesceGroup[0]->getType() == LLVMTypes::Int32VectorType ||
+             coalesceGroup[0]->getType() == LLVMTypes::FloatVectorType)
+        elementType = LLVMTypes::Int32Type;
     else if (coalesceGroup[0]->getType() == LLVMTypes::Int64VectorType ||
              coalesceGroup[0]->getType() == LLVMTypes::DoubleVectorType)
-        elementSize = 8;
+        elementType = LLVMTypes::Int64Type;
     else
         FATAL("Unexpected gather type in lCoalesceGathers");
+    int elementSize = elementType->getPrimitiveSizeInBits() / 8;
 
     // Extract the constant offsets from the gathers into the constOffsets
     // vector: the first vectorWidth elements will be those for the first
     // gather, the next vectorWidth those for the next gather, and so
     // forth.
     std::vector<int64_t> constOffsets;
-    lExtractConstOffsets(coalesceGroup, elementSize, &constOffsets);
+    if (!lExtractConstOffsets(coalesceGroup, elementSize, &constOffsets))
+        return false;
+
+    // Compute the shared base pointer for all of the gathers
+    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
 
     // Determine a set of loads to perform to get all of the values we need
     // loaded.
     std::vector<CoalescedLoadOp> loadOps;
-    lSelectLoads(constOffsets, &loadOps);
+    lSelectLoads(constOffsets, elementSize, &loadOps);
 
     lCoalescePerfInfo(coalesceGroup, loadOps);
 
     // Actually emit load instructions for them
-    lEmitLoads(basePtr, loadOps, elementSize, insertBefore);
+    lEmitLoads(basePtr, loadOps, elementType, insertBefore);
 
-    // Now, for any loads that give us <8 x i32> vectors, split their
-    // values into two <4 x i32> vectors; it turns out that LLVM gives us
-    // better code on AVX when we assemble the pieces from 4-wide vectors.
-    loadOps = lSplit8WideLoads(loadOps, insertBefore);
+    // Now, for any loads that give us 8 or 16-wide vectors, split their
+    // values into 4-wide vectors; it turns out that LLVM gives us better
+    // code on AVX when we assemble the pieces from 4-wide vectors.
+    loadOps = lSplitWideLoads(loadOps, insertBefore);
 
     // Given all of these chunks of values, shuffle together a vector that
     // gives us each result value; the i'th element of results[] gives the
     // result for the i'th gather in coalesceGroup.
     std::vector<llvm::Value *> results;
-    lAssembleResultVectors(loadOps, constOffsets, results, insertBefore);
+    lAssembleResultVectors(loadOps, constOffsets, elementType, results,
+                           insertBefore);
 
     // Finally, replace each of the original gathers with the instruction
     // that gives the value from the coalescing process.
@@ -4131,38 +4897,54 @@ lInstructionMayWriteToMemory(llvm::Instruction *inst) {
 }
 
 
-bool
-GatherCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
-    DEBUG_START_PASS("GatherCoalescePass");
+/** Returns true if the given function is one of the factored
+    base+offsets pseudo-gathers that the gather coalescing passes handle.
+ */
+static bool
+lIsCoalescableGatherFunc(llvm::Function *func) {
+    if (func == NULL)
+        return false;
 
     llvm::Function *gatherFuncs[] = {
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_i8"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_i16"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets32_i32"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets32_float"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_i64"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_double"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_i8"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_i16"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets64_i32"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets64_float"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_i64"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_double"),
     };
     int nGatherFuncs = sizeof(gatherFuncs) / sizeof(gatherFuncs[0]);
 
+    for (int i = 0; i < nGatherFuncs; ++i)
+        if (gatherFuncs[i] != NULL && func == gatherFuncs[i])
+            return true;
+    return false;
+}
+
+
+bool
+GatherCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
+    DEBUG_START_PASS("GatherCoalescePass");
+
     bool modifiedAny = false;
 
  restart:
     for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e;
          ++iter) {
         // Iterate over all of the instructions and look for calls to
-        // __pseudo_gather_factored_base_offsets{32,64}_{i32,float} calls.
+        // __pseudo_gather_factored_base_offsets{32,64}_* calls.
         llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
         if (callInst == NULL)
             continue;
 
         llvm::Function *calledFunc = callInst->getCalledFunction();
-        if (calledFunc == NULL)
-            continue;
-
-        int i;
-        for (i = 0; i < nGatherFuncs; ++i)
-            if (gatherFuncs[i] != NULL && calledFunc == gatherFuncs[i])
-                break;
-        if (i == nGatherFuncs)
+        if (!lIsCoalescableGatherFunc(calledFunc))
             // Doesn't match any of the types of gathers we care about
             continue;
 
@@ -4283,6 +5065,567 @@ CreateGatherCoalescePass() {
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// ScatterCoalescePass
+
+// This pass is the counterpart of GatherCoalescePass for stores.  Writing
+// a varying struct to an array of uniform structs (e.g. a[programIndex] =
+// v) turns into one scatter per struct member, all sharing the same base
+// pointer and uniform varying offset and differing only in their constant
+// offsets.  Taken together, those scatters often write a dense range of
+// memory, in which case we can shuffle their values together into a few
+// full-width vectors and write them with regular masked stores.
+//
+// The stores are emitted as __pseudo_masked_store_* calls, so that the
+// later passes turn them into plain vector stores when the mask is all
+// on, or pick between a blend and a true masked store otherwise.  Lanes
+// of the generated stores that don't correspond to any scattered value
+// have their mask turned off, so no memory is written that the original
+// scatters wouldn't have written.
+
+class ScatterCoalescePass : public llvm::BasicBlockPass {
+public:
+    static char ID;
+    ScatterCoalescePass() : BasicBlockPass(ID) { }
+
+    const char *getPassName() const { return "Scatter Coalescing"; }
+    bool runOnBasicBlock(llvm::BasicBlock &BB);
+};
+
+char ScatterCoalescePass::ID = 0;
+
+
+/** Shuffle two vectors together, folding the result to a constant if
+    both of the inputs are constants (so that masks built from constant
+    masks can still be recognized as such by lGetMaskStatus()). */
+static llvm::Value *
+lShuffleMaybeFold(llvm::Value *v1, llvm::Value *v2, int32_t shuf[],
+                  int shufSize, llvm::Instruction *insertBefore) {
+    llvm::Constant *c1 = llvm::dyn_cast<llvm::Constant>(v1);
+    llvm::Constant *c2 = llvm::dyn_cast<llvm::Constant>(v2);
+    if (c1 == NULL || c2 == NULL)
+        return LLVMShuffleVectors(v1, v2, shuf, shufSize, insertBefore);
+
+    std::vector<llvm::Constant *> shufVec;
+    for (int i = 0; i < shufSize; ++i)
+        shufVec.push_back(LLVMInt32(shuf[i]));
+    return llvm::ConstantExpr::getShuffleVector(c1, c2,
+                                                llvm::ConstantVector::get(shufVec));
+}
+
+
+/** Actually do the scatter coalescing.  As with lCoalesceGathers(), all
+    of the scatters in the group write to addresses of the form basePtr +
+    constOffset, with a basePtr shared by all of them.  The new stores are
+    emitted right before the last scatter in the group; the caller has
+    ensured that no instruction between the first and last one accesses
+    memory.
+ */
+static bool
+lCoalesceScatters(const std::vector<llvm::CallInst *> &coalesceGroup,
+                  llvm::Function *maskedStoreFunc) {
+    llvm::Instruction *insertBefore = coalesceGroup.back();
+    int width = g->target->getVectorWidth();
+
+    llvm::Type *valueType = coalesceGroup[0]->getArgOperand(4)->getType();
+    llvm::VectorType *valueVecType = llvm::dyn_cast<llvm::VectorType>(valueType);
+    Assert(valueVecType != NULL);
+    int elementSize =
+        valueVecType->getElementType()->getPrimitiveSizeInBits() / 8;
+
+    std::vector<int64_t> constOffsets;
+    if (!lExtractConstOffsets(coalesceGroup, elementSize, &constOffsets))
+        return false;
+
+    // Map from each offset written to the (scatter, lane) pair that
+    // provides its value.  If any location is written more than once, we
+    // don't try to figure out which write should win; just give up.
+    std::map<int64_t, int> offsetSource;
+    for (int i = 0; i < (int)constOffsets.size(); ++i) {
+        if (offsetSource.find(constOffsets[i]) != offsetSource.end())
+            return false;
+        offsetSource[constOffsets[i]] = i;
+    }
+
+    // Greedily cover the offsets with width-wide stores, each one starting
+    // at the lowest offset not yet covered.
+    std::vector<int64_t> storeStarts;
+    std::map<int64_t, int>::iterator iter = offsetSource.begin();
+    while (iter != offsetSource.end()) {
+        int64_t start = iter->first;
+        storeStarts.push_back(start);
+        while (iter != offsetSource.end() && iter->first < start + width)
+            ++iter;
+    }
+
+    // Only worth doing if we end up with no more stores than there were
+    // scatters to begin with.
+    if (storeStarts.size() > coalesceGroup.size())
+        return false;
+
+    SourcePos pos;
+    lGetSourcePosFromMetadata(coalesceGroup[0], &pos);
+    if (coalesceGroup.size() == 1)
+        PerformanceWarning(pos, "Coalesced scatter into %d vector store%s.",
+                           (int)storeStarts.size(),
+                           (storeStarts.size() > 1) ? "s" : "");
+    else
+        PerformanceWarning(pos, "Coalesced %d scatters starting here into "
+                           "%d vector store%s.", (int)coalesceGroup.size(),
+                           (int)storeStarts.size(),
+                           (storeStarts.size() > 1) ? "s" : "");
+
+    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
+    llvm::Value *mask = coalesceGroup[0]->getArgOperand(5);
+    llvm::Type *ptrType = llvm::PointerType::get(valueType, 0);
+
+    for (int s = 0; s < (int)storeStarts.size(); ++s) {
+        int64_t start = storeStarts[s];
+
+        // Assemble the value to be stored by shuffling in the
+        // contributions from each of the scatters in turn; lanes that
+        // aren't written keep their undef value and get a mask of off.
+        llvm::Value *value = llvm::UndefValue::get(valueType);
+        llvm::Value *storeMask = LLVMMaskAllOff;
+        int32_t maskShuf[ISPC_MAX_NVEC];
+        for (int lane = 0; lane < width; ++lane)
+            maskShuf[lane] = lane;
+
+        for (int i = 0; i < (int)coalesceGroup.size(); ++i) {
+            int32_t shuf[ISPC_MAX_NVEC];
+            bool anyLanes = false;
+            for (int lane = 0; lane < width; ++lane) {
+                shuf[lane] = lane;
+                std::map<int64_t, int>::iterator src =
+                    offsetSource.find(start + lane);
+                if (src != offsetSource.end() && src->second / width == i) {
+                    shuf[lane] = width + (src->second % width);
+                    maskShuf[lane] = width + (src->second % width);
+                    anyLanes = true;
+                }
+            }
+            if (anyLanes)
+                value = LLVMShuffleVectors(value, coalesceGroup[i]->getArgOperand(4),
+                                           shuf, width, insertBefore);
+        }
+        storeMask = lShuffleMaybeFold(storeMask, mask, maskShuf, width,
+                                      insertBefore);
+
+        llvm::Value *ptr = lGEPInst(basePtr, LLVMInt64(start * elementSize),
+                                    "scatter_base", insertBefore);
+        ptr = new llvm::BitCastInst(ptr, ptrType, "ptr_cast", insertBefore);
+        llvm::Instruction *store =
+            lCallInst(maskedStoreFunc, ptr, value, storeMask, "", insertBefore);
+        lCopyMetadata(store, coalesceGroup[0]);
+    }
+
+    for (int i = 0; i < (int)coalesceGroup.size(); ++i)
+        coalesceGroup[i]->eraseFromParent();
+
+    return true;
+}
+
+
+bool
+ScatterCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
+    DEBUG_START_PASS("ScatterCoalescePass");
+
+    struct SCInfo {
+        SCInfo(const char *sname, const char *msname) {
+            scatterFunc = m->module->getFunction(sname);
+            maskedStoreFunc = m->module->getFunction(msname);
+        }
+        llvm::Function *scatterFunc;
+        llvm::Function *maskedStoreFunc;
+    };
+
+    SCInfo scInfo[] = {
+        SCInfo("__pseudo_scatter_factored_base_offsets32_i8", "__pseudo_masked_store_i8"),
+        SCInfo("__pseudo_scatter_factored_base_offsets32_i16", "__pseudo_masked_store_i16"),
+        SCInfo("__pseudo_scatter_factored_base_offsets32_i32", "__pseudo_masked_store_i32"),
+        SCInfo("__pseudo_scatter_factored_base_offsets32_float", "__pseudo_masked_store_float"),
+        SCInfo("__pseudo_scatter_factored_base_offsets32_i64", "__pseudo_masked_store_i64"),
+        SCInfo("__pseudo_scatter_factored_base_offsets32_double", "__pseudo_masked_store_double"),
+        SCInfo("__pseudo_scatter_factored_base_offsets64_i8", "__pseudo_masked_store_i8"),
+        SCInfo("__pseudo_scatter_factored_base_offsets64_i16", "__pseudo_masked_store_i16"),
+        SCInfo("__pseudo_scatter_factored_base_offsets64_i32", "__pseudo_masked_store_i32"),
+        SCInfo("__pseudo_scatter_factored_base_offsets64_float", "__pseudo_masked_store_float"),
+        SCInfo("__pseudo_scatter_factored_base_offsets64_i64", "__pseudo_masked_store_i64"),
+        SCInfo("__pseudo_scatter_factored_base_offsets64_double", "__pseudo_masked_store_double"),
+    };
+    int nSCFuncs = sizeof(scInfo) / sizeof(scInfo[0]);
+
+    bool modifiedAny = false;
+
+ restart:
+    for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e;
+         ++iter) {
+        llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
+        if (callInst == NULL)
+            continue;
+
+        llvm::Function *calledFunc = callInst->getCalledFunction();
+        if (calledFunc == NULL)
+            continue;
+
+        SCInfo *info = NULL;
+        for (int i = 0; i < nSCFuncs; ++i)
+            if (scInfo[i].scatterFunc != NULL &&
+                calledFunc == scInfo[i].scatterFunc) {
+                info = &scInfo[i];
+                break;
+            }
+        if (info == NULL || info->maskedStoreFunc == NULL)
+            continue;
+
+        SourcePos pos;
+        lGetSourcePosFromMetadata(callInst, &pos);
+        Debug(pos, "Checking for coalescable scatters starting here...");
+
+        llvm::Value *base = callInst->getArgOperand(0);
+        llvm::Value *variableOffsets = callInst->getArgOperand(1);
+        llvm::Value *offsetScale = callInst->getArgOperand(2);
+        llvm::Value *mask = callInst->getArgOperand(5);
+
+        // As with gathers, we need the variable offsets to be uniform so
+        // that all of the addresses are constant offsets from a common
+        // base pointer.  Unlike gathers, the mask doesn't need to be all
+        // on, as it's carried over to the masked stores we generate.
+        if (lGetMaskStatus(mask) == ALL_OFF)
+            continue;
+        if (!LLVMVectorValuesAllEqual(variableOffsets))
+            continue;
+
+        std::vector<llvm::CallInst *> coalesceGroup;
+        coalesceGroup.push_back(callInst);
+
+        // The new stores are emitted at the position of the last scatter
+        // in the group, so we have to stop at anything that reads or
+        // writes memory (other than matching scatters), since it may
+        // otherwise see memory before the earlier scatters' writes.
+        llvm::BasicBlock::iterator fwdIter = iter;
+        ++fwdIter;
+        for (; fwdIter != bb.end(); ++fwdIter) {
+            llvm::CallInst *fwdCall = llvm::dyn_cast<llvm::CallInst>(&*fwdIter);
+            if (fwdCall != NULL &&
+                fwdCall->getCalledFunction() == calledFunc &&
+                base == fwdCall->getArgOperand(0) &&
+                variableOffsets == fwdCall->getArgOperand(1) &&
+                offsetScale == fwdCall->getArgOperand(2) &&
+                mask == fwdCall->getArgOperand(5)) {
+                SourcePos fwdPos;
+                lGetSourcePosFromMetadata(fwdCall, &fwdPos);
+                Debug(fwdPos, "This scatter can be coalesced.");
+                coalesceGroup.push_back(fwdCall);
+
+                if (coalesceGroup.size() == 4)
+                    // Same window size heuristic as GatherCoalescePass.
+                    break;
+                continue;
+            }
+
+            if (fwdIter->mayReadFromMemory() || fwdIter->mayWriteToMemory())
+                break;
+        }
+
+        Debug(pos, "Done with checking for matching scatters");
+
+        if (lCoalesceScatters(coalesceGroup, info->maskedStoreFunc)) {
+            modifiedAny = true;
+            goto restart;
+        }
+    }
+
+    DEBUG_END_PASS("ScatterCoalescePass");
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateScatterCoalescePass() {
+    return new ScatterCoalescePass;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// CrossBlockGatherCoalescePass
+
+// GatherCoalescePass only considers gathers within a single basic block
+// and stops extending a coalesce group at the first instruction that may
+// write to memory.  This pass picks up the remaining cases, where gathers
+// with a common base pointer are separated by control flow (e.g. reads of
+// different struct members before and after an "if"), or by calls and
+// stores that can't actually modify the memory being read.
+//
+// A later gather is added to the group started by an earlier one when the
+// earlier one dominates it and it post-dominates the earlier one (so that
+// both always execute together and issuing all of the loads at the first
+// gather doesn't introduce any speculative memory accesses), and when
+// alias analysis shows that nothing that may execute between the two can
+// modify memory through their shared base pointer.  The actual coalescing
+// is then done by lCoalesceGathers(), just as in GatherCoalescePass.
+
+class CrossBlockGatherCoalescePass : public llvm::FunctionPass {
+public:
+    static char ID;
+    CrossBlockGatherCoalescePass() : FunctionPass(ID) { }
+
+    const char *getPassName() const { return "Cross-Block Gather Coalescing"; }
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+    bool runOnFunction(llvm::Function &F);
+
+private:
+    bool mayClobber(llvm::Instruction *inst, llvm::Value *ptr);
+    bool mayClobberBetween(llvm::Instruction *from, llvm::Instruction *to,
+                           llvm::Value *ptr);
+    bool alwaysExecutedWith(llvm::BasicBlock *bb, llvm::BasicBlock *other);
+
+    llvm::AliasAnalysis *AA;
+    llvm::DominatorTree *DT;
+    llvm::PostDominatorTree *PDT;
+
+    /** Cached results of alwaysExecutedWith() for the current function. */
+    std::map<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>, bool> executedWith;
+};
+
+char CrossBlockGatherCoalescePass::ID = 0;
+
+
+void
+CrossBlockGatherCoalescePass::getAnalysisUsage(llvm::AnalysisUsage &AU) const {
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4)
+    AU.addRequired<llvm::DominatorTree>();
+#else // LLVM 3.5+
+    AU.addRequired<llvm::DominatorTreeWrapperPass>();
+#endif
+    AU.addRequired<llvm::PostDominatorTree>();
+    AU.addRequired<llvm::AliasAnalysis>();
+    AU.setPreservesCFG();
+}
+
+
+/** Returns true if the given instruction may write to memory that is
+    accessed through the given pointer. */
+bool
+CrossBlockGatherCoalescePass::mayClobber(llvm::Instruction *inst,
+                                         llvm::Value *ptr) {
+    if (!lInstructionMayWriteToMemory(inst))
+        return false;
+
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4) || defined(LLVM_3_5) || defined(LLVM_3_6)
+    llvm::AliasAnalysis::Location loc(ptr);
+    return (AA->getModRefInfo(inst, loc) & llvm::AliasAnalysis::Mod) != 0;
+#else // LLVM 3.7+
+    llvm::MemoryLocation loc(ptr);
+    return (AA->getModRefInfo(inst, loc) & llvm::AliasAnalysis::Mod) != 0;
+#endif
+}
+
+
+/** Returns true if any instruction that may execute after "from" and
+    before "to" may write to memory accessed through ptr.  The caller
+    guarantees that "from" dominates "to".  If "from" can be reached again
+    before "to" (i.e. we're in a loop), conservatively returns true.
+ */
+bool
+CrossBlockGatherCoalescePass::mayClobberBetween(llvm::Instruction *from,
+                                                llvm::Instruction *to,
+                                                llvm::Value *ptr) {
+    llvm::BasicBlock *fromBB = from->getParent();
+    llvm::BasicBlock *toBB = to->getParent();
+
+    llvm::BasicBlock::iterator iter(from);
+    ++iter;
+    if (fromBB == toBB) {
+        for (; &*iter != to; ++iter)
+            if (mayClobber(&*iter, ptr))
+                return true;
+        return false;
+    }
+
+    // The rest of the block the first gather is in and the start of the
+    // block with the second one...
+    for (; iter != fromBB->end(); ++iter)
+        if (mayClobber(&*iter, ptr))
+            return true;
+    for (iter = toBB->begin(); &*iter != to; ++iter)
+        if (mayClobber(&*iter, ptr))
+            return true;
+
+    // ...and all of the blocks that are on a path between the two.
+    std::set<llvm::BasicBlock *> visited;
+    std::vector<llvm::BasicBlock *> worklist;
+    worklist.push_back(fromBB);
+    while (worklist.size() > 0) {
+        llvm::BasicBlock *bb = worklist.back();
+        worklist.pop_back();
+
+        llvm::TerminatorInst *term = bb->getTerminator();
+        for (unsigned int i = 0; i < term->getNumSuccessors(); ++i) {
+            llvm::BasicBlock *succ = term->getSuccessor(i);
+            if (succ == toBB)
+                continue;
+            if (succ == fromBB)
+                return true;
+            if (visited.find(succ) != visited.end())
+                continue;
+            visited.insert(succ);
+
+            for (iter = succ->begin(); iter != succ->end(); ++iter)
+                if (mayClobber(&*iter, ptr))
+                    return true;
+            worklist.push_back(succ);
+        }
+    }
+    return false;
+}
+
+
+/** Returns true if the given basic block can be reached again from its
+    own successors without passing through the "avoid" block; in other
+    words, if it's in a loop that doesn't contain "avoid". */
+static bool
+lReachableAvoiding(llvm::BasicBlock *bb, llvm::BasicBlock *avoid) {
+    std::set<llvm::BasicBlock *> visited;
+    std::vector<llvm::BasicBlock *> worklist;
+    worklist.push_back(bb);
+    while (worklist.size() > 0) {
+        llvm::TerminatorInst *term = worklist.back()->getTerminator();
+        worklist.pop_back();
+        for (unsigned int i = 0; i < term->getNumSuccessors(); ++i) {
+            llvm::BasicBlock *succ = term->getSuccessor(i);
+            if (succ == bb)
+                return true;
+            if (succ == avoid || visited.find(succ) != visited.end())
+                continue;
+            visited.insert(succ);
+            worklist.push_back(succ);
+        }
+    }
+    return false;
+}
+
+
+/** Returns true if the "other" block is executed exactly when "bb" is:
+    "bb" dominates it, it post-dominates "bb", and it isn't in a loop that
+    doesn't also contain "bb". */
+bool
+CrossBlockGatherCoalescePass::alwaysExecutedWith(llvm::BasicBlock *bb,
+                                                 llvm::BasicBlock *other) {
+    std::pair<llvm::BasicBlock *, llvm::BasicBlock *> key(bb, other);
+    std::map<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>, bool>::iterator iter =
+        executedWith.find(key);
+    if (iter != executedWith.end())
+        return iter->second;
+
+    bool result = (DT->dominates(bb, other) &&
+                   PDT->dominates(other, bb) &&
+                   !lReachableAvoiding(other, bb));
+    executedWith[key] = result;
+    return result;
+}
+
+
+bool
+CrossBlockGatherCoalescePass::runOnFunction(llvm::Function &F) {
+#if defined(LLVM_3_2) || defined(LLVM_3_3) || defined(LLVM_3_4)
+    DT = &getAnalysis<llvm::DominatorTree>();
+#else // LLVM 3.5+
+    DT = &getAnalysis<llvm::DominatorTreeWrapperPass>().getDomTree();
+#endif
+    PDT = &getAnalysis<llvm::PostDominatorTree>();
+    AA = &getAnalysis<llvm::AliasAnalysis>();
+    executedWith.clear();
+
+    // Find all of the gathers that may be coalesced, in program order,
+    // grouped by the operands that have to match for two of them to be
+    // coalesced: the gather function, base pointer, varying offsets and
+    // offset scale.  Coalescing only adds loads and shuffles, so this set
+    // doesn't need to be recomputed after each group is coalesced.
+    std::map<std::vector<llvm::Value *>, std::vector<llvm::CallInst *> > candidates;
+    for (llvm::Function::iterator bbIter = F.begin(); bbIter != F.end();
+         ++bbIter) {
+        for (llvm::BasicBlock::iterator iter = bbIter->begin();
+             iter != bbIter->end(); ++iter) {
+            llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
+            if (callInst == NULL ||
+                !lIsCoalescableGatherFunc(callInst->getCalledFunction()))
+                continue;
+
+            llvm::Value *variableOffsets = callInst->getArgOperand(1);
+            if (lGetMaskStatus(callInst->getArgOperand(4)) != ALL_ON ||
+                !LLVMVectorValuesAllEqual(variableOffsets))
+                continue;
+
+            std::vector<llvm::Value *> key;
+            key.push_back(callInst->getCalledFunction());
+            key.push_back(callInst->getArgOperand(0));
+            key.push_back(variableOffsets);
+            key.push_back(callInst->getArgOperand(2));
+            candidates[key].push_back(callInst);
+        }
+    }
+
+    bool modifiedAny = false;
+    std::set<llvm::CallInst *> coalesced;
+
+    std::map<std::vector<llvm::Value *>, std::vector<llvm::CallInst *> >::iterator iter;
+    for (iter = candidates.begin(); iter != candidates.end(); ++iter) {
+        const std::vector<llvm::CallInst *> &gathers = iter->second;
+        // Single gathers have already been handled by GatherCoalescePass.
+        if (gathers.size() < 2)
+            continue;
+
+        for (int i = 0; i < (int)gathers.size(); ++i) {
+            llvm::CallInst *callInst = gathers[i];
+            if (coalesced.find(callInst) != coalesced.end())
+                continue;
+
+            llvm::BasicBlock *bb = callInst->getParent();
+            llvm::Value *base = callInst->getArgOperand(0);
+
+            std::vector<llvm::CallInst *> coalesceGroup;
+            coalesceGroup.push_back(callInst);
+
+            // Look for matching gathers either later in this block or in
+            // other blocks that are always executed together with this one.
+            for (int j = 0; j < (int)gathers.size() &&
+                     coalesceGroup.size() < 4; ++j) {
+                llvm::CallInst *fwdCall = gathers[j];
+                if (j == i || coalesced.find(fwdCall) != coalesced.end())
+                    continue;
+
+                llvm::BasicBlock *otherBB = fwdCall->getParent();
+                if (otherBB == bb ? (j < i) : !alwaysExecutedWith(bb, otherBB))
+                    continue;
+
+                if (mayClobberBetween(callInst, fwdCall, base))
+                    continue;
+
+                SourcePos fwdPos;
+                lGetSourcePosFromMetadata(fwdCall, &fwdPos);
+                Debug(fwdPos, "This gather can be coalesced across blocks.");
+                coalesceGroup.push_back(fwdCall);
+            }
+
+            if (coalesceGroup.size() > 1 && lCoalesceGathers(coalesceGroup)) {
+                modifiedAny = true;
+                coalesced.insert(coalesceGroup.begin(), coalesceGroup.end());
+            }
+        }
+    }
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateCrossBlockGatherCoalescePass() {
+    return new CrossBlockGatherCoalescePass;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // ReplacePseudoMemoryOpsPass
 
@@ -4406,6 +5749,22 @@ lReplacePseudoMaskedStore(llvm::CallInst *callInst) {
 }
 
 
+/** Given one of the factored gather builtins, returns the variant of it
+    that checks whether all active lanes load from the same address (and
+    then does a single scalar load and broadcast) before falling back to
+    the gather, or NULL if there is no such variant for this target.
+ */
+static llvm::Function *
+lGetDedupGatherFunc(llvm::Function *gatherFunc) {
+    const std::string prefix = "__gather_factored_";
+    std::string name = gatherFunc->getName().str();
+    if (name.compare(0, prefix.size(), prefix) != 0)
+        return NULL;
+    name = "__gather_dedup_factored_" + name.substr(prefix.size());
+    return m->module->getFunction(name);
+}
+
+
 static bool
 lReplacePseudoGS(llvm::CallInst *callInst) {
     struct LowerGSInfo {
@@ -4595,9 +5954,16 @@ lReplacePseudoGS(llvm::CallInst *callInst) {
     SourcePos pos;
     bool gotPosition = lGetSourcePosFromMetadata(callInst, &pos);
 
-    callInst->setCalledFunction(info->actualFunc);
+    llvm::Function *dedupFunc = NULL;
+    if (info->isGather && g->opt.dedupGathers)
+        dedupFunc = lGetDedupGatherFunc(info->actualFunc);
+
+    callInst->setCalledFunction(dedupFunc != NULL ? dedupFunc : info->actualFunc);
     if (gotPosition && g->target->getVectorWidth() > 1) {
-        if (info->isGather)
+        if (dedupFunc != NULL)
+            PerformanceWarning(pos, "Gather required to load value (checking "
+                               "for a shared address first).");
+        else if (info->isGather)
             PerformanceWarning(pos, "Gather required to load value.");
         else if (!info->isPrefetch)
             PerformanceWarning(pos, "Scatter required to store value.");
@@ -4629,6 +5995,27 @@ ReplacePseudoMemoryOpsPass::runOnBasicBlock(llvm::BasicBlock &bb) {
         }
     }
 
+    if (!g->statsFileName.empty()) {
+        // Tally up the memory operations emitted during lowering for the
+        // --stats report.  Functions that are later removed as unused
+        // (e.g. ones that were inlined everywhere) are still counted.
+        for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e; ++iter) {
+            llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
+            if (callInst == NULL || callInst->getCalledFunction() == NULL)
+                continue;
+
+            llvm::StringRef name = callInst->getCalledFunction()->getName();
+            if (name.startswith("__gather"))
+                StatsCount("gathers");
+            else if (name.startswith("__scatter"))
+                StatsCount("scatters");
+            else if (name.startswith("__masked_load_"))
+                StatsCount("masked_loads");
+            else if (name.startswith("__masked_store_"))
+                StatsCount("masked_stores");
+        }
+    }
+
     DEBUG_END_PASS("ReplacePseudoMemoryOpsPass");
 
     return modifiedAny;
@@ -4781,6 +6168,140 @@ CreateDebugPass(char * output) {
     return new DebugPass(output);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// RemoveUnneededBuiltinsPass
+
+/** The target's gather, scatter, masked load and store, and prefetch
+    builtins are all kept alive by calls from __keep_funcs_live() until
+    the end of optimization, since the optimization passes may introduce
+    calls to them.  This means that the definitions of all of them go
+    through all of the optimization passes, even though only the ones for
+    the element types of the program's own pseudo gathers, scatters, and
+    masked stores can actually end up being called.  This pass, which
+    runs before the others, turns the rest into declarations (which
+    __keep_funcs_live() keeps around for the passes that look them up).
+ */
+class RemoveUnneededBuiltinsPass : public llvm::ModulePass {
+public:
+    static char ID;
+    RemoveUnneededBuiltinsPass() : ModulePass(ID) {
+    }
+
+    const char *getPassName() const { return "Remove unneeded builtins"; }
+    bool runOnModule(llvm::Module &m);
+};
+
+char RemoveUnneededBuiltinsPass::ID = 0;
+
+
+// Returns the part of the given name after its last underscore, which
+// for the builtins handled here gives the element type ("i32", "float",
+// ...) or the prefetch variant ("1", "nt", ...).
+static std::string
+lGetBuiltinTypeSuffix(const std::string &name) {
+    size_t pos = name.rfind('_');
+    return (pos == std::string::npos) ? std::string() : name.substr(pos + 1);
+}
+
+
+bool
+RemoveUnneededBuiltinsPass::runOnModule(llvm::Module &module) {
+    llvm::Function *keepLive = module.getFunction("__keep_funcs_live");
+    if (keepLive == NULL || keepLive->empty())
+        return false;
+
+    const char *families[] = {
+        "__gather32_", "__gather64_",
+        "__gather_base_offsets32_", "__gather_base_offsets64_",
+        "__gather_factored_base_offsets32_", "__gather_factored_base_offsets64_",
+        "__gather_dedup_factored_base_offsets32_",
+        "__gather_dedup_factored_base_offsets64_",
+        "__gather_elt32_", "__gather_elt64_",
+        "__gather_strided_",
+        "__masked_load_",
+        "__scatter32_", "__scatter64_",
+        "__scatter_base_offsets32_", "__scatter_base_offsets64_",
+        "__scatter_factored_base_offsets32_", "__scatter_factored_base_offsets64_",
+        "__scatter_elt32_", "__scatter_elt64_",
+        "__scatter_strided_",
+        "__masked_store_", "__masked_store_blend_",
+        "__prefetch_read_varying_",
+    };
+    const char *suffixes[] = {
+        "i8", "i16", "i32", "i64", "float", "double", "1", "2", "3", "nt"
+    };
+
+    std::set<llvm::Function *> candidates;
+    for (unsigned int i = 0; i < sizeof(families) / sizeof(families[0]); ++i)
+        for (unsigned int j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); ++j) {
+            llvm::Function *func =
+                module.getFunction(std::string(families[i]) + suffixes[j]);
+            if (func != NULL && func->empty() == false)
+                candidates.insert(func);
+        }
+
+    // Find all of the functions referenced from code other than
+    // __keep_funcs_live(), starting with all of the functions that aren't
+    // candidates for removal and then adding the candidates that they
+    // (transitively) refer to.
+    std::set<llvm::Function *> referenced;
+    std::vector<llvm::Function *> worklist;
+    for (llvm::Module::iterator iter = module.begin(); iter != module.end(); ++iter)
+        if (&*iter != keepLive && candidates.find(&*iter) == candidates.end())
+            worklist.push_back(&*iter);
+
+    while (worklist.size() > 0) {
+        llvm::Function *func = worklist.back();
+        worklist.pop_back();
+
+        for (llvm::Function::iterator bb = func->begin(); bb != func->end(); ++bb)
+            for (llvm::BasicBlock::iterator inst = bb->begin(); inst != bb->end(); ++inst)
+                for (unsigned int i = 0; i < inst->getNumOperands(); ++i) {
+                    llvm::Function *callee =
+                        llvm::dyn_cast<llvm::Function>(inst->getOperand(i)->stripPointerCasts());
+                    if (callee == NULL || referenced.find(callee) != referenced.end())
+                        continue;
+                    referenced.insert(callee);
+                    if (candidates.find(callee) != candidates.end())
+                        worklist.push_back(callee);
+                }
+    }
+
+    // The optimization passes only introduce calls to builtins with the
+    // same element type as the pseudo-operations they start from.
+    std::set<std::string> neededSuffixes;
+    for (std::set<llvm::Function *>::iterator iter = referenced.begin();
+         iter != referenced.end(); ++iter) {
+        std::string name = (*iter)->getName().str();
+        if (name.find("__pseudo_") == 0)
+            neededSuffixes.insert(lGetBuiltinTypeSuffix(name));
+    }
+
+    bool modifiedAny = false;
+    for (std::set<llvm::Function *>::iterator iter = candidates.begin();
+         iter != candidates.end(); ++iter) {
+        llvm::Function *func = *iter;
+        if (referenced.find(func) != referenced.end() ||
+            neededSuffixes.find(lGetBuiltinTypeSuffix(func->getName().str())) !=
+                neededSuffixes.end())
+            continue;
+
+        Debug(SourcePos(), "Removing definition of unneeded builtin \"%s\".",
+              func->getName().str().c_str());
+        func->deleteBody();
+        modifiedAny = true;
+    }
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateRemoveUnneededBuiltinsPass() {
+    return new RemoveUnneededBuiltinsPass;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // MakeInternalFuncsStaticPass
 
@@ -4841,6 +6362,15 @@ MakeInternalFuncsStaticPass::runOnModule(llvm::Module &module) {
         "__gather64_i8", "__gather64_i16",
         "__gather64_i32", "__gather64_i64",
         "__gather64_float", "__gather64_double",
+        "__gather_strided_i8", "__gather_strided_i16",
+        "__gather_strided_i32", "__gather_strided_i64",
+        "__gather_strided_float", "__gather_strided_double",
+        "__gather_dedup_factored_base_offsets32_i8", "__gather_dedup_factored_base_offsets32_i16",
+        "__gather_dedup_factored_base_offsets32_i32", "__gather_dedup_factored_base_offsets32_i64",
+        "__gather_dedup_factored_base_offsets32_float", "__gather_dedup_factored_base_offsets32_double",
+        "__gather_dedup_factored_base_offsets64_i8", "__gather_dedup_factored_base_offsets64_i16",
+        "__gather_dedup_factored_base_offsets64_i32", "__gather_dedup_factored_base_offsets64_i64",
+        "__gather_dedup_factored_base_offsets64_float", "__gather_dedup_factored_base_offsets64_double",
         "__gather_elt32_i8", "__gather_elt32_i16",
         "__gather_elt32_i32", "__gather_elt32_i64",
         "__gather_elt32_float", "__gather_elt32_double",
@@ -4880,6 +6410,9 @@ MakeInternalFuncsStaticPass::runOnModule(llvm::Module &module) {
         "__scatter64_i8", "__scatter64_i16",
         "__scatter64_i32", "__scatter64_i64",
         "__scatter64_float", "__scatter64_double",
+        "__scatter_strided_i8", "__scatter_strided_i16",
+        "__scatter_strided_i32", "__scatter_strided_i64",
+        "__scatter_strided_float", "__scatter_strided_double",
         "__prefetch_read_varying_1", "__prefetch_read_varying_2",
         "__prefetch_read_varying_3", "__prefetch_read_varying_nt",
         "__keep_funcs_live",
@@ -258,8 +258,9 @@ struct ForeachDimension {
 %type <foreachDimension> foreach_dimension_specifier
 %type <foreachDimensionList> foreach_dimension_list
 
-%type <declspecPair> declspec_item
+%type <declspecPair> declspec_item declspec_name
 %type <declspecList> declspec_specifier declspec_list
+%type <stringVal> declspec_value_list declspec_value
 
 %start translation_unit
 %%
@@ -752,7 +753,7 @@ soa_width_specifier
       { $$ = $3; }
     ;
 
-declspec_item
+declspec_name
     : TOKEN_IDENTIFIER
     {
         std::pair<std::string, SourcePos> *p = new std::pair<std::string, SourcePos>;
@@ -762,6 +763,42 @@ declspec_item
     }
     ;
 
+declspec_value
+    : int_constant
+    {
+        char buf[32];
+        sprintf(buf, "%lld", (long long)$1);
+        $$ = new std::string(buf);
+    }
+    | '-' int_constant
+    {
+        char buf[32];
+        sprintf(buf, "%lld", -(long long)$2);
+        $$ = new std::string(buf);
+    }
+    ;
+
+declspec_value_list
+    : declspec_value
+    | declspec_value_list ',' declspec_value
+    {
+        $$ = $1;
+        *$$ += ",";
+        *$$ += *$3;
+    }
+    ;
+
+/* Values given with a __declspec, as in "specialize(1, 2, 4)", are
+   carried along in its string as "specialize(1,2,4)". */
+declspec_item
+    : declspec_name
+    | declspec_name '(' declspec_value_list ')'
+    {
+        $$ = $1;
+        $$->first += "(" + *$3 + ")";
+    }
+    ;
+
 declspec_list
     : declspec_item
     {
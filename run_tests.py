@@ -152,6 +152,31 @@ def check_test(filename):
     return done
 
 
+# Returns any extra ispc command-line flags that the test asks for with a
+# "// ispc-flags: ..." line, e.g. to enable an optional optimization.
+def test_flags(filename):
+    file = open(filename, 'r')
+    flags = re.search('^// *ispc-flags:(.*)$', file.read(), re.MULTILINE)
+    file.close()
+    if flags == None:
+        return ""
+    return flags.group(1).strip()
+
+
+# When compiling for several targets at once, ispc writes the code for
+# each target to its own object file, next to the one with the dispatch
+# functions.  Return the names of those files.
+def multi_target_objs(obj_name, target):
+    isa_names = { "avx1" : "avx", "avx1.1" : "avx11", "avx512knl" : "knl" }
+    base = obj_name[:obj_name.rfind('.')]
+    suffix = obj_name[obj_name.rfind('.'):]
+    objs = []
+    for t in target.split(','):
+        isa = t.split('-')[0]
+        objs.append("%s_%s%s" % (base, isa_names.get(isa, isa), suffix))
+    return objs
+
+
 def run_test(testname):
     # testname is a path to the test from the root of ispc dir
     # filename is a path to the test from the current dir
@@ -198,7 +223,9 @@ def run_test(testname):
         # We need to figure out the signature of the test
         # function that this test has.
         sig2def = { "f_v(" : 0, "f_f(" : 1, "f_fu(" : 2, "f_fi(" : 3,
-                    "f_du(" : 4, "f_duf(" : 5, "f_di(" : 6, "f_sz" : 7 }
+                    "f_du(" : 4, "f_duf(" : 5, "f_di(" : 6, "f_sz" : 7,
+                    "f_fui(" : 8, "f_fv(" : 9,
+                    "f_fa(" : 10 }
         file = open(filename, 'r')
         match = -1
         for line in file:
@@ -274,6 +301,8 @@ def run_test(testname):
                     cc_cmd = "%s -O2 -I. %s %s test_static.cpp -DTEST_SIG=%d %s -o %s" % \
                          (options.compiler_exe, gcc_arch, gcc_isa, match, obj_name, exe_name)                    
 
+                if options.target.find(',') != -1:
+                    cc_cmd += " " + " ".join(multi_target_objs(obj_name, options.target))
                 if platform.system() == 'Darwin':
                     cc_cmd += ' -Wl,-no_pie'
                 if should_fail:
@@ -320,6 +349,9 @@ def run_test(testname):
                          (filename4ptx, obj_name, options.target)
 
         # compile the ispc code, make the executable, and run it...
+        flags = test_flags(filename)
+        if flags != "":
+            ispc_cmd += " " + flags
         ispc_cmd += " -h " + filename + ".h"
         cc_cmd += " -DTEST_HEADER=<" + filename + ".h>"
         (compile_error, run_error) = run_cmds([ispc_cmd, cc_cmd], 
@@ -337,6 +369,9 @@ def run_test(testname):
                         os.unlink("%s.pdb" % basename)
                         os.unlink("%s.ilk" % basename)
                 os.unlink(obj_name)
+                if options.target.find(',') != -1:
+                    for obj in multi_target_objs(obj_name, options.target):
+                        os.unlink(obj)
         except:
             None
 
@@ -1016,6 +1016,67 @@ lHasVaryingBreakOrContinue(Stmt *stmt) {
 }
 
 
+/** Preorder callback function for lCanVersionLoop(); flags statements
+    that can't be emitted twice or that would make the duplicated body
+    more trouble than it's worth. */
+static bool
+lVersionLoopPreFunc(ASTNode *node, void *d) {
+    bool *ok = (bool *)d;
+
+    if (dynamic_cast<ForStmt *>(node) != NULL ||
+        dynamic_cast<DoStmt *>(node) != NULL ||
+        dynamic_cast<ForeachStmt *>(node) != NULL ||
+        dynamic_cast<ForeachActiveStmt *>(node) != NULL ||
+        dynamic_cast<ForeachUniqueStmt *>(node) != NULL ||
+        dynamic_cast<BreakStmt *>(node) != NULL ||
+        dynamic_cast<ContinueStmt *>(node) != NULL ||
+        dynamic_cast<ReturnStmt *>(node) != NULL ||
+        dynamic_cast<GotoStmt *>(node) != NULL ||
+        dynamic_cast<LabeledStmt *>(node) != NULL) {
+        *ok = false;
+        return false;
+    }
+
+    DeclStmt *ds = dynamic_cast<DeclStmt *>(node);
+    if (ds != NULL) {
+        for (unsigned int i = 0; i < ds->vars.size(); ++i) {
+            Symbol *sym = ds->vars[i].sym;
+            if (sym != NULL && sym->storageClass == SC_STATIC) {
+                *ok = false;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+/** Determines whether a varying loop with the given body should be
+    versioned: i.e. whether the body should be emitted a second time with
+    the mask set to "all on", to be run for as long as all of the program
+    instances are still executing the loop, as is done for "cfor" and
+    "cdo" loops.  We only do this for small bodies without nested loops
+    (so the code size increase stays bounded) and without statements that
+    transfer control or can't be emitted twice.
+ */
+static bool
+lCanVersionLoop(Stmt *body) {
+    if (body == NULL ||
+        g->opt.level == 0 ||
+        g->opt.disableCoherentControlFlow ||
+        g->opt.disableMaskAllOnOptimizations ||
+        g->target->getMaskingIsFree())
+        return false;
+
+    if (EstimateCost(body) > VERSION_VARYING_LOOP_MAX_COST)
+        return false;
+
+    bool ok = true;
+    WalkAST(body, lVersionLoopPreFunc, NULL, &ok);
+    return ok;
+}
+
+
 DoStmt::DoStmt(Expr *t, Stmt *s, bool cc, SourcePos p)
     : Stmt(p), testExpr(t), bodyStmts(s),
       doCoherentCheck(cc && !g->opt.disableCoherentControlFlow) {
@@ -1058,7 +1119,7 @@ void DoStmt::EmitCode(FunctionEmitContext *ctx) const {
     ctx->AddInstrumentationPoint("do loop body");
     ctx->AddProfileUpdate("do loop body", PROFILE_REGION_LOOP); 
 
-    if (doCoherentCheck && !uniformTest) {
+    if (!uniformTest && (doCoherentCheck || lCanVersionLoop(bodyStmts))) {
         // Check to see if the mask is all on
         llvm::BasicBlock *bAllOn = ctx->CreateBasicBlock("do_all_on");
         llvm::BasicBlock *bMixed = ctx->CreateBasicBlock("do_mixed");
@@ -1267,10 +1328,11 @@ ForStmt::EmitCode(FunctionEmitContext *ctx) const {
     if (!dynamic_cast<StmtList *>(stmts))
         ctx->StartScope();
 
-    if (doCoherentCheck && !uniformTest) {
-        // For 'varying' loops with the coherence check, we start by
-        // checking to see if the mask is all on, after it has been updated
-        // based on the value of the test.
+    if (!uniformTest && (doCoherentCheck || lCanVersionLoop(stmts))) {
+        // For 'varying' loops with the coherence check (either requested
+        // with "cfor" or added automatically for small loop bodies), we
+        // start by checking to see if the mask is all on, after it has
+        // been updated based on the value of the test.
         llvm::BasicBlock *bAllOn = ctx->CreateBasicBlock("for_all_on");
         llvm::BasicBlock *bMixed = ctx->CreateBasicBlock("for_mixed");
         ctx->BranchIfMaskAll(bAllOn, bMixed);
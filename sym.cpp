@@ -43,6 +43,10 @@
 ///////////////////////////////////////////////////////////////////////////
 // Symbol
 
+/** All of the symbols that have been allocated and not yet freed, in the
+    order they were allocated. */
+static std::vector<Symbol *> lAllocatedSymbols;
+
 Symbol::Symbol(const std::string &n, SourcePos p, const Type *t,
                StorageClass sc)
   : pos(p), name(n) {
@@ -53,6 +57,22 @@ Symbol::Symbol(const std::string &n, SourcePos p, const Type *t,
     storageClass = sc;
     varyingCFDepth = 0;
     parentFunction = NULL;
+    lAllocatedSymbols.push_back(this);
+}
+
+
+size_t
+GetSymbolMark() {
+    return lAllocatedSymbols.size();
+}
+
+
+void
+FreeSymbols(size_t mark) {
+    Assert(mark <= lAllocatedSymbols.size());
+    for (size_t i = mark; i < lAllocatedSymbols.size(); ++i)
+        delete lAllocatedSymbols[i];
+    lAllocatedSymbols.resize(mark);
 }
 
 
@@ -65,9 +85,12 @@ SymbolTable::SymbolTable() {
 
 
 SymbolTable::~SymbolTable() {
-    // Otherwise we have mismatched push/pop scopes
-    Assert(variables.size() == 1);
-    PopScope();
+    // Scopes may still be open if there was a parse error.  The symbols
+    // themselves are freed with FreeSymbols().
+    for (unsigned int i = 0; i < variables.size(); ++i)
+        delete variables[i];
+    for (unsigned int i = 0; i < freeSymbolMaps.size(); ++i)
+        delete freeSymbolMaps[i];
 }
 
 
@@ -108,6 +108,15 @@ public:
 };
 
 
+/** As with AST nodes, each Symbol is recorded when it's allocated, since
+    they're shared between the symbol table, the AST and types.
+    GetSymbolMark() returns a marker for the symbols allocated so far, and
+    FreeSymbols() frees all of the symbols allocated after the given
+    marker. */
+extern size_t GetSymbolMark();
+extern void FreeSymbols(size_t mark);
+
+
 /** @brief Symbol table that holds all known symbols during parsing and compilation.
 
     A single instance of a SymbolTable is stored in the Module class
@@ -70,6 +70,9 @@ extern "C" {
     extern void f_du(float *result, double *a, double b);
     extern void f_duf(float *result, double *a, float b);
     extern void f_di(float *result, double *a, int *b);
+    extern void f_fui(float *result, float *a, int b);
+    extern void f_fv(float *result, void *a);
+    extern void f_fa_async(float *result, float *a, void **handlePtr);
     extern void result(float *val);
 
     void ISPCLaunch(void **handlePtr, void *f, void *d, int,int,int);
@@ -77,8 +80,7 @@ extern "C" {
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
 }
 
-void ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int count2) {
-    *handle = (void *)0xdeadbeef;
+static void lRunTasks(void *f, void *d, int count0, int count1, int count2) {
     typedef void (*TaskFuncType)(void *, int, int, int, int, int, int, int, int, int, int);
     TaskFuncType func = (TaskFuncType)f;
     int count = count0*count1*count2, idx = 0;
@@ -88,8 +90,41 @@ void ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int cou
         func(d, 0, 1, idx++, count, i,j,k,count0,count1,count2);
 }
 
+#if (TEST_SIG == 10)
+// Tests of asynchronous functions check that the tasks don't run until
+// the handle is passed to ISPCSync(), so launches are deferred until then.
+struct PendingLaunch {
+    void *f, *d;
+    int count0, count1, count2;
+};
+static PendingLaunch pendingLaunches[64];
+static int numPendingLaunches = 0;
+
+void ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int count2) {
+    *handle = (void *)0xdeadbeef;
+    assert(numPendingLaunches < 64);
+    PendingLaunch pl = { f, d, count0, count1, count2 };
+    pendingLaunches[numPendingLaunches++] = pl;
+}
+
+void ISPCSync(void *handle) {
+    assert(handle == (void *)0xdeadbeef);
+    // Tasks may launch more tasks, which are added to the end.
+    for (int i = 0; i < numPendingLaunches; ++i) {
+        PendingLaunch pl = pendingLaunches[i];
+        lRunTasks(pl.f, pl.d, pl.count0, pl.count1, pl.count2);
+    }
+    numPendingLaunches = 0;
+}
+#else
+void ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int count2) {
+    *handle = (void *)0xdeadbeef;
+    lRunTasks(f, d, count0, count1, count2);
+}
+
 void ISPCSync(void *) {
 }
+#endif // TEST_SIG == 10
 
 
 void *ISPCAlloc(void **handle, int64_t size, int32_t alignment) {
@@ -154,6 +189,18 @@ int main(int argc, char *argv[]) {
     f_di(returned_result, vdouble, vint2);
 #elif (TEST_SIG == 7)
     *returned_result = sizeof(ispc::f_sz);
+#elif (TEST_SIG == 8)
+    f_fui(returned_result, vfloat, 5);
+#elif (TEST_SIG == 9)
+    f_fv(returned_result, vfloat);
+#elif (TEST_SIG == 10)
+    void *handle = NULL;
+    f_fa_async(returned_result, vfloat, &handle);
+    if (handle == NULL || numPendingLaunches == 0) {
+        printf("%s: no tasks pending after the _async call returned\n", argv[0]);
+        return 1;
+    }
+    ISPCSync(handle);
 #else
 #error "Unknown or unset TEST_SIG value"
 #endif
@@ -2872,6 +2872,7 @@ FunctionType::FunctionType(const Type *r,
     Assert(returnType != NULL);
     isSafe = false;
     costOverride = -1;
+    isAsync = false;
 }
 
 
@@ -2890,6 +2891,7 @@ FunctionType::FunctionType(const Type *r,
     Assert(returnType != NULL);
     isSafe = false;
     costOverride = -1;
+    isAsync = false;
 }
 
 
@@ -2986,6 +2988,8 @@ FunctionType::ResolveUnboundVariability(Variability v) const {
                                          isExternC, isUnmasked);
     ret->isSafe = isSafe;
     ret->costOverride = costOverride;
+    ret->isAsync = isAsync;
+    ret->specializations = specializations;
 
     return ret;
 }
@@ -732,6 +732,10 @@ public:
         be between 0 and NumElements()-1. */
     const Type *GetElementType(int i) const;
 
+    /** Returns the type of the i'th structure element as it was declared,
+        without resolving unbound variability against the struct's. */
+    const Type *GetRawElementType(int i) const { return elementTypes[i]; }
+
     /** Returns which structure element number (starting from zero) that
         has the given name.  If there is no such element, return -1. */
     int GetElementNumber(const std::string &name) const;
@@ -963,6 +967,15 @@ public:
         function estimate for the function. */
     int costOverride;
 
+    /** Indicates whether an asynchronous variant of this exported function
+        should be emitted, as requested with __declspec(async). */
+    bool isAsync;
+
+    /** For each parameter with a __declspec(specialize(...)) annotation,
+        this gives the parameter's index and the values that specialized
+        versions of the exported function should be generated for. */
+    std::vector<std::pair<int, std::vector<int64_t> > > specializations;
+
 private:
     const Type * const returnType;
 
@@ -59,11 +59,14 @@
 #include <windows.h>
 #else
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <errno.h>
 #endif // ISPC_IS_WINDOWS
 #include <set>
+#include <map>
 #include <algorithm>
+#include <llvm/Support/Timer.h>
 
 #if defined(LLVM_3_2)
   #include <llvm/DataLayout.h>
@@ -657,3 +660,172 @@ VerifyDataLayoutCompatibility(const std::string &module_dl,
     return true;
 }
 
+
+
+///////////////////////////////////////////////////////////////////////////
+// StatsTimer
+
+struct PhaseStats {
+    PhaseStats() : seconds(0.), count(0), peakRSSKB(0) { }
+    double seconds;
+    int count;
+    long peakRSSKB;
+};
+
+/** Statistics for each phase, in the order that the phases were first
+    seen. */
+static std::vector<std::pair<std::string, PhaseStats> > lPhaseStats;
+/** Time spent in each phase for each function. */
+static std::map<std::string, std::map<std::string, double> > lFunctionStats;
+static std::map<std::string, int> lStatsCounts;
+/** The timers for the phases that are currently in progress. */
+static std::vector<StatsTimer *> lActiveTimers;
+static double lStatsStartSeconds = -1.;
+
+
+static double
+lWallSeconds() {
+    return llvm::TimeRecord::getCurrentTime(true).getWallTime();
+}
+
+
+/** Returns the peak resident set size of the process so far, in kB, or
+    zero if it isn't available. */
+static long
+lPeakRSSKB() {
+#ifdef ISPC_IS_WINDOWS
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef ISPC_IS_APPLE
+    // OS X reports bytes rather than kB.
+    return (long)(usage.ru_maxrss / 1024);
+#else
+    return (long)usage.ru_maxrss;
+#endif
+#endif // ISPC_IS_WINDOWS
+}
+
+
+StatsTimer::StatsTimer(const char *p, const std::string &f) {
+    phase = p;
+    function = f;
+    nestedSeconds = 0.;
+    startSeconds = -1.;
+    if (g->statsFileName.empty())
+        return;
+
+    startSeconds = lWallSeconds();
+    if (lStatsStartSeconds < 0.)
+        lStatsStartSeconds = startSeconds;
+    lActiveTimers.push_back(this);
+}
+
+
+StatsTimer::~StatsTimer() {
+    if (startSeconds < 0.)
+        return;
+
+    double elapsed = lWallSeconds() - startSeconds;
+    Assert(lActiveTimers.size() > 0 && lActiveTimers.back() == this);
+    lActiveTimers.pop_back();
+    if (lActiveTimers.size() > 0)
+        lActiveTimers.back()->nestedSeconds += elapsed;
+    double seconds = elapsed - nestedSeconds;
+
+    PhaseStats *stats = NULL;
+    for (unsigned int i = 0; i < lPhaseStats.size(); ++i)
+        if (lPhaseStats[i].first == phase)
+            stats = &lPhaseStats[i].second;
+    if (stats == NULL) {
+        lPhaseStats.push_back(std::make_pair(std::string(phase), PhaseStats()));
+        stats = &lPhaseStats.back().second;
+    }
+    stats->seconds += seconds;
+    ++stats->count;
+    stats->peakRSSKB = std::max(stats->peakRSSKB, lPeakRSSKB());
+
+    if (!function.empty())
+        lFunctionStats[function][phase] += seconds;
+}
+
+
+void
+StatsCount(const char *counter, int amount) {
+    if (!g->statsFileName.empty())
+        lStatsCounts[counter] += amount;
+}
+
+
+/** Prints the given string to the file as a JSON string literal. */
+static void
+lPrintJSONString(FILE *f, const std::string &str) {
+    fputc('"', f);
+    for (unsigned int i = 0; i < str.size(); ++i) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+
+bool
+WriteStats() {
+    FILE *f = (g->statsFileName == "-") ? stdout :
+        fopen(g->statsFileName.c_str(), "w");
+    if (f == NULL) {
+        perror(g->statsFileName.c_str());
+        return false;
+    }
+
+    double totalSeconds = (lStatsStartSeconds < 0.) ? 0. :
+        lWallSeconds() - lStatsStartSeconds;
+    fprintf(f, "{\n  \"total\": { \"seconds\": %.6f, \"peak_rss_kb\": %ld },\n",
+            totalSeconds, lPeakRSSKB());
+
+    fprintf(f, "  \"phases\": {");
+    for (unsigned int i = 0; i < lPhaseStats.size(); ++i) {
+        const PhaseStats &stats = lPhaseStats[i].second;
+        fprintf(f, "%s\n    ", (i == 0) ? "" : ",");
+        lPrintJSONString(f, lPhaseStats[i].first);
+        fprintf(f, ": { \"seconds\": %.6f, \"count\": %d, \"peak_rss_kb\": %ld }",
+                stats.seconds, stats.count, stats.peakRSSKB);
+    }
+    fprintf(f, "\n  },\n");
+
+    fprintf(f, "  \"functions\": {");
+    std::map<std::string, std::map<std::string, double> >::const_iterator iter;
+    for (iter = lFunctionStats.begin(); iter != lFunctionStats.end(); ++iter) {
+        fprintf(f, "%s\n    ", (iter == lFunctionStats.begin()) ? "" : ",");
+        lPrintJSONString(f, iter->first);
+        fprintf(f, ": {");
+        std::map<std::string, double>::const_iterator piter;
+        for (piter = iter->second.begin(); piter != iter->second.end(); ++piter) {
+            fprintf(f, "%s ", (piter == iter->second.begin()) ? "" : ",");
+            lPrintJSONString(f, piter->first);
+            fprintf(f, ": %.6f", piter->second);
+        }
+        fprintf(f, " }");
+    }
+    fprintf(f, "\n  },\n");
+
+    fprintf(f, "  \"counts\": {");
+    std::map<std::string, int>::const_iterator citer;
+    for (citer = lStatsCounts.begin(); citer != lStatsCounts.end(); ++citer) {
+        fprintf(f, "%s\n    ", (citer == lStatsCounts.begin()) ? "" : ",");
+        lPrintJSONString(f, citer->first);
+        fprintf(f, ": %d", citer->second);
+    }
+    fprintf(f, "\n  }\n}\n");
+
+    if (f != stdout)
+        fclose(f);
+    return true;
+}
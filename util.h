@@ -170,4 +170,33 @@ void PrintWithWordBreaks(const char *buf, int indent, int columnWidth,
  */
 int TerminalWidth();
 
+/** Measures a phase of compilation for the report requested with the
+    --stats option: the wall-clock time from the object's construction to
+    its destruction is added to the phase's total, along with the process's
+    peak memory use at the end.  If a function name is given, the time is
+    also added to that function's entry in the report.  Time spent in
+    phases that are measured while this one is in progress is only
+    counted for those phases. */
+class StatsTimer {
+public:
+    StatsTimer(const char *phase, const std::string &function = "");
+    ~StatsTimer();
+
+    /** Time spent in phases started while this one was in progress. */
+    double nestedSeconds;
+
+private:
+    const char *phase;
+    std::string function;
+    double startSeconds;
+};
+
+/** Adds the given amount to the named counter in the --stats report. */
+void StatsCount(const char *counter, int amount = 1);
+
+/** Writes the report of the statistics gathered during compilation to the
+    file given with the --stats option, in JSON format.  Returns false if
+    it couldn't be written. */
+bool WriteStats();
+
 #endif // ISPC_UTIL_H